@@ -16,6 +16,7 @@
  */
 
 #include "host.h"
+#include "midichase.h"
 
 #include <float.h>
 #include <math.h>
@@ -25,17 +26,41 @@
 #include <stdio.h>
 #include <string.h>
 
-#include <sndfile.h>
+// maximum number of MIDI events passed between racks per block
+#define MAX_MIDI_EVENTS 512
+
+// the plugin chain is split into several Carla-Rack instances, one per tap point
+typedef struct KURIBOROSU_RACK_T {
+    NativePluginHandle plugin_handle;
+    CarlaHostHandle carla_handle;
+    // output of this rack is written to this file, NULL for the last rack (regular output)
+    char* tap_filename;
+} kuriborosu_rack_t;
 
 typedef struct _Kuriborosu {
     uint32_t buffer_size;
     uint32_t sample_rate;
     const NativePluginDescriptor* plugin_descriptor;
-    NativePluginHandle plugin_handle;
     NativeHostDescriptor host_descriptor;
-    CarlaHostHandle carla_handle;
+    kuriborosu_rack_t* racks;
+    uint32_t rack_count;
     NativeTimeInfo time;
     bool plugin_needs_idle;
+    // MIDI output of the rack being processed, becomes input of the next one
+    NativeMidiEvent midi_buffers[2][MAX_MIDI_EVENTS];
+    NativeMidiEvent* midi_in;
+    NativeMidiEvent* midi_out;
+    uint32_t midi_in_count;
+    uint32_t midi_out_count;
+    // MIDI input file, its controller state is chased into chase_rack when rendering from a later position
+    bool chase_enabled;
+    char* chase_filename;
+    bool chase_split_pending;
+    uint32_t chase_rack;
+    NativeMidiEvent* chase_events;
+    uint32_t chase_count;
+    uint32_t chase_pos;
+    NativeMidiEvent midi_chase_buffer[MAX_MIDI_EVENTS];
 } Kuriborosu;
 
 #define kuriborosu ((Kuriborosu*)handle)
@@ -65,11 +90,11 @@ static const NativeTimeInfo* get_time_info(const NativeHostHandle handle)
 
 static bool write_midi_event(const NativeHostHandle handle, const NativeMidiEvent* const event)
 {
-    return false;
+    if (kuriborosu->midi_out_count == MAX_MIDI_EVENTS)
+        return false;
 
-    // unused
-    (void)handle;
-    (void)event;
+    kuriborosu->midi_out[kuriborosu->midi_out_count++] = *event;
+    return true;
 }
 
 static void ui_parameter_changed(const NativeHostHandle handle, const uint32_t index, const float value)
@@ -174,6 +199,65 @@ static void carla_safe_assert(const char* const assertion, const char* const fil
     carla_stderr2("Kuriborosu assertion failure: \"%s\" in file %s, line %i", assertion, file, line);
 }
 
+static bool add_rack(Kuriborosu* const kuri)
+{
+    kuriborosu_rack_t* const racks = (kuriborosu_rack_t*)realloc(kuri->racks,
+                                                                sizeof(kuriborosu_rack_t)*(kuri->rack_count + 1));
+
+    if (racks == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    kuri->racks = racks;
+
+    kuriborosu_rack_t* const rack = &racks[kuri->rack_count];
+    memset(rack, 0, sizeof(kuriborosu_rack_t));
+
+    rack->plugin_handle = kuri->plugin_descriptor->instantiate(&kuri->host_descriptor);
+
+    if (rack->plugin_handle == NULL)
+    {
+        fprintf(stderr, "Failed to instantiate Carla-Rack plugin\n");
+        return false;
+    }
+
+    rack->carla_handle = carla_create_native_plugin_host_handle(kuri->plugin_descriptor,
+                                                                rack->plugin_handle);
+
+    if (rack->carla_handle == NULL)
+    {
+        fprintf(stderr, "Failed to create Carla-Rack host handle\n");
+        kuri->plugin_descriptor->cleanup(rack->plugin_handle);
+        return false;
+    }
+
+    kuri->plugin_descriptor->activate(rack->plugin_handle);
+
+    ++kuri->rack_count;
+    return true;
+}
+
+static CarlaHostHandle get_last_carla_handle(Kuriborosu* const kuri)
+{
+    return kuri->racks[kuri->rack_count - 1].carla_handle;
+}
+
+// MIDI input files get a rack of their own, so chased state can be injected between them and the next plugins
+static bool apply_pending_chase_split(Kuriborosu* const kuri)
+{
+    if (! kuri->chase_split_pending)
+        return true;
+
+    if (! add_rack(kuri))
+        return false;
+
+    kuri->chase_split_pending = false;
+    kuri->chase_rack = kuri->rack_count - 1;
+    return true;
+}
+
 Kuriborosu* kuriborosu_host_init(const uint32_t buffer_size, const uint32_t sample_rate)
 {
     Kuriborosu* const kuri = (Kuriborosu*)malloc(sizeof(Kuriborosu));
@@ -184,6 +268,8 @@ Kuriborosu* kuriborosu_host_init(const uint32_t buffer_size, const uint32_t samp
     memset(kuri, 0, sizeof(Kuriborosu));
     kuri->buffer_size = buffer_size;
     kuri->sample_rate = sample_rate;
+    kuri->midi_in = kuri->midi_buffers[0];
+    kuri->midi_out = kuri->midi_buffers[1];
 
     kuri->host_descriptor.handle = kuri;
     kuri->host_descriptor.resourceDir = carla_get_library_folder();
@@ -208,31 +294,13 @@ Kuriborosu* kuriborosu_host_init(const uint32_t buffer_size, const uint32_t samp
         goto error;
     }
 
-    kuri->plugin_handle = kuri->plugin_descriptor->instantiate(&kuri->host_descriptor);
-
-    if (kuri->plugin_handle == NULL)
-    {
-        fprintf(stderr, "Failed to instantiate Carla-Rack plugin\n");
+    if (! add_rack(kuri))
         goto error;
-    }
-
-    kuri->carla_handle = carla_create_native_plugin_host_handle(kuri->plugin_descriptor,
-                                                                kuri->plugin_handle);
-
-    if (kuri->carla_handle == NULL)
-    {
-        fprintf(stderr, "Failed to create Carla-Rack host handle\n");
-        goto cleanup;
-    }
-
-    kuri->plugin_descriptor->activate(kuri->plugin_handle);
 
     return kuri;
 
-cleanup:
-    kuri->plugin_descriptor->cleanup(kuri->plugin_handle);
-
 error:
+    free(kuri->racks);
     free(kuri);
     return NULL;
 }
@@ -241,9 +309,18 @@ void kuriborosu_host_destroy(Kuriborosu* const kuri)
 {
     CARLA_SAFE_ASSERT_RETURN(kuri != NULL,);
 
-    kuri->plugin_descriptor->deactivate(kuri->plugin_handle);
-    kuri->plugin_descriptor->cleanup(kuri->plugin_handle);
-    carla_host_handle_free(kuri->carla_handle);
+    for (uint32_t r = 0; r < kuri->rack_count; ++r)
+    {
+        kuriborosu_rack_t* const rack = &kuri->racks[r];
+
+        kuri->plugin_descriptor->deactivate(rack->plugin_handle);
+        kuri->plugin_descriptor->cleanup(rack->plugin_handle);
+        carla_host_handle_free(rack->carla_handle);
+        free(rack->tap_filename);
+    }
+
+    free(kuri->racks);
+    free(kuri->chase_filename);
     free(kuri);
 }
 
@@ -252,35 +329,53 @@ bool kuriborosu_host_load_file(Kuriborosu* const kuri, const char* const filenam
     CARLA_SAFE_ASSERT_RETURN(kuri != NULL, false);
     CARLA_SAFE_ASSERT_RETURN(filename != NULL, false);
 
-    const uint32_t plugin_id = carla_get_current_plugin_count(kuri->carla_handle);
+    if (! apply_pending_chase_split(kuri))
+        return false;
+
+    const CarlaHostHandle carla_handle = get_last_carla_handle(kuri);
+    const uint32_t plugin_id = carla_get_current_plugin_count(carla_handle);
 
-    if (carla_load_file(kuri->carla_handle, filename))
+    if (carla_load_file(carla_handle, filename))
     {
         // Disable audiofile looping
-        if (strcmp(carla_get_real_plugin_name(kuri->carla_handle, plugin_id), "Audio File") == 0)
+        if (strcmp(carla_get_real_plugin_name(carla_handle, plugin_id), "Audio File") == 0)
         {
-            const uint32_t parameter_count = carla_get_parameter_count(kuri->carla_handle, plugin_id);
+            const uint32_t parameter_count = carla_get_parameter_count(carla_handle, plugin_id);
 
             for (uint32_t i=0; i<parameter_count; ++i)
             {
-                const CarlaParameterInfo* const info = carla_get_parameter_info(kuri->carla_handle, plugin_id, i);
+                const CarlaParameterInfo* const info = carla_get_parameter_info(carla_handle, plugin_id, i);
 
                 if (strcmp(info->name, "Loop Mode") == 0)
                 {
-                    carla_set_parameter_value(kuri->carla_handle, plugin_id, i, 0.0f);
+                    carla_set_parameter_value(carla_handle, plugin_id, i, 0.0f);
                     break;
                 }
             }
         }
+        // MIDI file as input, remember it for chasing
+        else if (kuri->chase_enabled && kuri->rack_count == 1 && plugin_id == 0 &&
+                 strcmp(carla_get_real_plugin_name(carla_handle, plugin_id), "MIDI File") == 0)
+        {
+            kuri->chase_filename = strdup(filename);
+            kuri->chase_split_pending = kuri->chase_filename != NULL;
+        }
 
         return true;
     }
 
     fprintf(stderr, "Failed to load file %s, error was: %s\n",
-            filename, carla_get_last_error(kuri->carla_handle));
+            filename, carla_get_last_error(carla_handle));
     return false;
 }
 
+void kuriborosu_host_enable_midi_chase(Kuriborosu* const kuri, const bool enabled)
+{
+    CARLA_SAFE_ASSERT_RETURN(kuri != NULL,);
+
+    kuri->chase_enabled = enabled;
+}
+
 bool kuriborosu_host_set_plugin_custom_data(Kuriborosu* kuri, const char* type, const char* key, const char* value)
 {
     CARLA_SAFE_ASSERT_RETURN(kuri != NULL, false);
@@ -288,12 +383,13 @@ bool kuriborosu_host_set_plugin_custom_data(Kuriborosu* kuri, const char* type,
     CARLA_SAFE_ASSERT_RETURN(key != NULL, false);
     CARLA_SAFE_ASSERT_RETURN(value != NULL, false);
 
-    const uint32_t plugin_count = carla_get_current_plugin_count(kuri->carla_handle);
+    const CarlaHostHandle carla_handle = get_last_carla_handle(kuri);
+    const uint32_t plugin_count = carla_get_current_plugin_count(carla_handle);
     CARLA_SAFE_ASSERT_RETURN(plugin_count != 0, false);
 
     const uint32_t plugin_id = plugin_count - 1;
 
-    carla_set_custom_data(kuri->carla_handle, plugin_id, type, key, value);
+    carla_set_custom_data(carla_handle, plugin_id, type, key, value);
     printf("set custom data '%s'\n", value);
     return true;
 }
@@ -303,145 +399,448 @@ bool kuriborosu_host_load_plugin(Kuriborosu* kuri, const char* filenameOrUID)
     CARLA_SAFE_ASSERT_RETURN(kuri != NULL, false);
     CARLA_SAFE_ASSERT_RETURN(filenameOrUID != NULL, false);
 
-    if (carla_add_plugin(kuri->carla_handle, BINARY_NATIVE, PLUGIN_LV2, "", "", filenameOrUID, 0, NULL, PLUGIN_OPTIONS_NULL))
+    if (! apply_pending_chase_split(kuri))
+        return false;
+
+    const CarlaHostHandle carla_handle = get_last_carla_handle(kuri);
+
+    if (carla_add_plugin(carla_handle, BINARY_NATIVE, PLUGIN_LV2, "", "", filenameOrUID, 0, NULL, PLUGIN_OPTIONS_NULL))
         return true;
 
     fprintf(stderr, "Failed to load plugin %s, error was: %s\n",
-            filenameOrUID, carla_get_last_error(kuri->carla_handle));
+            filenameOrUID, carla_get_last_error(carla_handle));
     return false;
 }
 
-bool kuriborosu_host_render_to_file(Kuriborosu* const kuri, const file_render_options_t* const options)
+bool kuriborosu_host_add_tap(Kuriborosu* const kuri, const char* const filename)
 {
     CARLA_SAFE_ASSERT_RETURN(kuri != NULL, false);
-    CARLA_SAFE_ASSERT_RETURN(options != NULL, false);
+    CARLA_SAFE_ASSERT_RETURN(filename != NULL, false);
 
-    const uint32_t buffer_size = kuri->buffer_size;
-    const uint32_t sample_rate = kuri->sample_rate;
+    if (carla_get_current_plugin_count(get_last_carla_handle(kuri)) == 0)
+    {
+        fprintf(stderr, "Cannot add tap %s, there are no plugins since the previous tap\n", filename);
+        return false;
+    }
 
-    float* const bufN = malloc(sizeof(float)*buffer_size*2);
-    float* const bufL = malloc(sizeof(float)*buffer_size);
-    float* const bufR = malloc(sizeof(float)*buffer_size);
+    char* const tap_filename = strdup(filename);
 
-    if (bufN == NULL || bufL == NULL || bufR == NULL)
+    if (tap_filename == NULL)
     {
         fprintf(stderr, "Out of memory\n");
         return false;
     }
 
-    SF_INFO sf_fmt = {
-        .frames = 0,
-        .samplerate = sample_rate,
-        .channels = 2,
-        .format = SF_FORMAT_WAV|SF_FORMAT_PCM_16,
-        .sections = 0,
-        .seekable = 0,
-    };
-    SNDFILE* const file = sf_open(options->filename, SFM_WRITE, &sf_fmt);
+    // plugins loaded from now on go into a new rack, so the output of the current one can be tapped
+    if (! add_rack(kuri))
+    {
+        free(tap_filename);
+        return false;
+    }
 
-    // TODO check file NULL or error
+    kuri->racks[kuri->rack_count - 2].tap_filename = tap_filename;
 
-    if (file == NULL)
+    if (kuri->chase_split_pending)
     {
-        goto free;
+        kuri->chase_split_pending = false;
+        kuri->chase_rack = kuri->rack_count - 1;
     }
 
-    // Turn on clipping and normalization of floats (-1.0 - 1.0)
-    sf_command(file, SFC_SET_CLIPPING, NULL, SF_TRUE);
-    sf_command(file, SFC_SET_NORM_FLOAT, NULL, SF_TRUE);
+    return true;
+}
 
-    float* inbuf[2] = { bufN, bufN + buffer_size };
-    float* outbuf[2] = { bufL, bufR };
+typedef struct RENDER_OUTPUT_T {
+    KuriborosuWriter* writer;
+    // discarded from the start of the render, pre-roll plus latency of the plugin chain up to this output
+    uint64_t offset;
+    // render position where output stops being written, UINT64_MAX if there is a tail
+    uint64_t end;
+} render_output_t;
+
+typedef struct RENDER_STATS_T {
+    KuriborosuTelemetry* telemetry;
+    double start_time;
+    double process_time;
+    double write_time;
+    // peak of the last rack output since the previous progress report
+    float peaks[2];
+} render_stats_t;
+
+// sum of all plugin latencies in a rack, plugins inside a rack always run in series
+static uint32_t get_rack_latency(Kuriborosu* const kuri, const uint32_t rack)
+{
+    const CarlaHostHandle carla_handle = kuri->racks[rack].carla_handle;
+    const uint32_t plugin_count = carla_get_current_plugin_count(carla_handle);
+    uint32_t latency = 0;
 
-    kuri->time.playing = true;
-    kuri->time.bbt.valid = true;
-    kuri->time.bbt.beatsPerBar    = 4;
-    kuri->time.bbt.beatType       = 4;
-    kuri->time.bbt.ticksPerBeat   = 1920;
-    kuri->time.bbt.beatsPerMinute = 120;
+    for (uint32_t i = 0; i < plugin_count; ++i)
+        latency += carla_get_plugin_latency(carla_handle, i);
+
+    return latency;
+}
+
+static uint64_t get_max_render_frames(const file_render_options_t* const options,
+                                      const uint32_t buffer_size, const uint32_t sample_rate, const uint32_t latency)
+{
+    // processing always happens in full buffers, so the last one can go over
+    uint64_t frames = (uint64_t)options->frames + latency + buffer_size;
 
-    // start
-    kuri->time.bbt.bar  = 1;
-    kuri->time.bbt.beat = 1;
+    if (options->tail_mode == tail_mode_continue_until_silence)
+        frames += ((uint64_t)5 * sample_rate + buffer_size - 1) / buffer_size * buffer_size;
+
+    return frames;
+}
 
-    for (uint32_t i = 0; i < options->frames; i += buffer_size)
+// set transport position, BBT is derived from it using the fixed tempo and time signature
+static void set_time_frame(Kuriborosu* const kuri, const uint64_t frame)
+{
+    NativeTimeInfoBBT* const bbt = &kuri->time.bbt;
+    const double ticks = (double)frame * bbt->ticksPerBeat * bbt->beatsPerMinute / (kuri->sample_rate * 60.0);
+    const uint64_t beats = (uint64_t)(ticks / bbt->ticksPerBeat);
+    const uint64_t bars = beats / (uint64_t)bbt->beatsPerBar;
+
+    kuri->time.frame = frame;
+    bbt->bar = (int32_t)bars + 1;
+    bbt->beat = (int32_t)(beats - bars * (uint64_t)bbt->beatsPerBar) + 1;
+    bbt->tick = ticks - beats * bbt->ticksPerBeat;
+    bbt->barStartTick = bars * bbt->beatsPerBar * bbt->ticksPerBeat;
+}
+
+// run a single block through all racks, writing the output of each rack to its writer
+// the interleaved output of the last rack is left in bufN
+static bool process_racks(Kuriborosu* const kuri, const render_output_t* const outputs, const uint64_t pos,
+                          render_stats_t* const stats, float* const bufN, float* bufA, float* bufB)
+{
+    const uint32_t buffer_size = kuri->buffer_size;
+    KuriborosuTelemetry* const telemetry = stats->telemetry;
+
+    // first rack has no audio or MIDI input
+    memset(bufA, 0, sizeof(float)*buffer_size*2);
+    kuri->midi_in_count = 0;
+
+    for (uint32_t r = 0; r < kuri->rack_count; ++r)
     {
-        kuri->time.frame = i;
-        memset(bufN, 0, sizeof(float)*buffer_size*2);
-        kuri->plugin_descriptor->process(kuri->plugin_handle, inbuf, outbuf, buffer_size, NULL, 0);
+        const float* inbuf[2] = { bufA, bufA + buffer_size };
+        float* outbuf[2] = { bufB, bufB + buffer_size };
+
+        const NativeMidiEvent* midi_events = kuri->midi_in;
+        uint32_t midi_event_count = kuri->midi_in_count;
+
+        // chased MIDI state goes before anything else, spread over several blocks if needed
+        if (r == kuri->chase_rack && kuri->chase_pos < kuri->chase_count)
+        {
+            uint32_t chased = kuri->chase_count - kuri->chase_pos;
+            if (chased > MAX_MIDI_EVENTS / 2)
+                chased = MAX_MIDI_EVENTS / 2;
+
+            uint32_t passed = kuri->midi_in_count;
+            if (passed > MAX_MIDI_EVENTS - chased)
+                passed = MAX_MIDI_EVENTS - chased;
+
+            memcpy(kuri->midi_chase_buffer, kuri->chase_events + kuri->chase_pos, sizeof(NativeMidiEvent)*chased);
+            memcpy(kuri->midi_chase_buffer + chased, kuri->midi_in, sizeof(NativeMidiEvent)*passed);
+            kuri->chase_pos += chased;
+
+            midi_events = kuri->midi_chase_buffer;
+            midi_event_count = chased + passed;
+        }
+
+        const double process_start = kuriborosu_telemetry_get_time(telemetry);
+
+        kuri->midi_out_count = 0;
+        kuri->plugin_descriptor->process(kuri->racks[r].plugin_handle, inbuf, outbuf, buffer_size,
+                                         midi_events, midi_event_count);
+
+        const double write_start = kuriborosu_telemetry_get_time(telemetry);
+        stats->process_time += write_start - process_start;
 
         // interleave
         for (uint32_t j = 0, k = 0; k < buffer_size; j += 2, ++k)
         {
-            bufN[j+0] = bufL[k];
-            bufN[j+1] = bufR[k];
+            bufN[j+0] = outbuf[0][k];
+            bufN[j+1] = outbuf[1][k];
         }
 
-        sf_writef_float(file, bufN, buffer_size);
+        // skip plugin latency at the start and anything past the end
+        const render_output_t* const output = &outputs[r];
+        const uint64_t start = pos > output->offset ? pos : output->offset;
+        const uint64_t end = pos + buffer_size < output->end ? pos + buffer_size : output->end;
+
+        if (output->writer != NULL && start < end &&
+            ! kuriborosu_writer_write(output->writer, bufN + (start - pos) * 2, (uint32_t)(end - start)))
+            return false;
+
+        stats->write_time += kuriborosu_telemetry_get_time(telemetry) - write_start;
+
+        // output of this rack becomes input of the next
+        float* const tmpbuf = bufA;
+        bufA = bufB;
+        bufB = tmpbuf;
+
+        NativeMidiEvent* const tmpmidi = kuri->midi_in;
+        kuri->midi_in = kuri->midi_out;
+        kuri->midi_out = tmpmidi;
+        kuri->midi_in_count = kuri->midi_out_count;
+    }
+
+    if (telemetry != NULL)
+    {
+        for (uint32_t j = 0; j < buffer_size * 2; j += 2)
+        {
+            if (fabsf(bufN[j+0]) > stats->peaks[0])
+                stats->peaks[0] = fabsf(bufN[j+0]);
+            if (fabsf(bufN[j+1]) > stats->peaks[1])
+                stats->peaks[1] = fabsf(bufN[j+1]);
+        }
+    }
+
+    if (kuri->plugin_needs_idle)
+    {
+        kuri->plugin_needs_idle = false;
+
+        for (uint32_t r = 0; r < kuri->rack_count; ++r)
+            kuri->plugin_descriptor->dispatcher(kuri->racks[r].plugin_handle,
+                                                NATIVE_PLUGIN_OPCODE_IDLE, 0, 0, NULL, 0.0f);
+    }
+
+    return true;
+}
+
+// rate-limited, so it is fine to call on every block
+static void report_progress(Kuriborosu* const kuri, const render_output_t* const outputs, render_stats_t* const stats,
+                            const char* const phase, const uint64_t done, const uint64_t total)
+{
+    KuriborosuTelemetry* const telemetry = stats->telemetry;
+
+    if (! kuriborosu_telemetry_should_report(telemetry))
+        return;
+
+    const double elapsed = kuriborosu_telemetry_get_time(telemetry) - stats->start_time;
+    const double frames_per_second = elapsed > 0.0 ? done / elapsed : 0.0;
+    uint64_t pending = 0;
+
+    for (uint32_t r = 0; r < kuri->rack_count; ++r)
+        pending += kuriborosu_writer_get_pending_frames(outputs[r].writer);
+
+    kuriborosu_telemetry_begin(telemetry, "progress");
+    kuriborosu_telemetry_add_string(telemetry, "phase", phase);
+    kuriborosu_telemetry_add_uint(telemetry, "frames_done", done);
+    kuriborosu_telemetry_add_uint(telemetry, "frames_total", total);
+    kuriborosu_telemetry_add_double(telemetry, "realtime_factor", frames_per_second / kuri->sample_rate);
+    kuriborosu_telemetry_add_double(telemetry, "eta", frames_per_second > 0.0 && total > done
+                                                      ? (total - done) / frames_per_second : 0.0);
+    kuriborosu_telemetry_add_double(telemetry, "peak_db_left", 20.0 * log10(stats->peaks[0]));
+    kuriborosu_telemetry_add_double(telemetry, "peak_db_right", 20.0 * log10(stats->peaks[1]));
+    kuriborosu_telemetry_add_uint(telemetry, "writer_pending_frames", pending);
+    kuriborosu_telemetry_end(telemetry);
+
+    stats->peaks[0] = stats->peaks[1] = 0.0f;
+}
+
+bool kuriborosu_host_render_to_file(Kuriborosu* const kuri, const file_render_options_t* const options)
+{
+    CARLA_SAFE_ASSERT_RETURN(kuri != NULL, false);
+    CARLA_SAFE_ASSERT_RETURN(options != NULL, false);
+
+    const uint32_t buffer_size = kuri->buffer_size;
+    const uint32_t sample_rate = kuri->sample_rate;
+    // transport starts before the requested position, output during pre-roll is discarded
+    const uint32_t seek = options->start > options->preroll ? options->start - options->preroll : 0;
+    const uint32_t preroll = options->start - seek;
+    uint32_t latency = 0;
+    uint64_t pos = 0;
+    bool ok = true;
+
+    render_stats_t stats = {
+        .telemetry = options->telemetry,
+        .start_time = kuriborosu_telemetry_get_time(options->telemetry),
+    };
+
+    float* const bufN = malloc(sizeof(float)*buffer_size*2);
+    float* const bufA = malloc(sizeof(float)*buffer_size*2);
+    float* const bufB = malloc(sizeof(float)*buffer_size*2);
+    render_output_t* const outputs = calloc(kuri->rack_count, sizeof(render_output_t));
+
+    if (bufN == NULL || bufA == NULL || bufB == NULL || outputs == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        ok = false;
+        goto free;
+    }
+
+    // each output is compensated by the latency of the plugins before it
+    for (uint32_t r = 0; r < kuri->rack_count; ++r)
+    {
+        latency += get_rack_latency(kuri, r);
+        outputs[r].offset = (uint64_t)preroll + latency;
+        outputs[r].end = options->tail_mode == tail_mode_none ? outputs[r].offset + options->frames : UINT64_MAX;
+    }
+
+    if (latency != 0)
+        printf("compensating %u frames of plugin latency\n", latency);
 
-        if (kuri->plugin_needs_idle)
+    // one writer per tap, last rack goes into the regular output file
+    // racks split off for MIDI chasing have no tap and no writer
+    for (uint32_t r = 0; r < kuri->rack_count; ++r)
+    {
+        const char* const filename = r + 1 == kuri->rack_count ? options->filename : kuri->racks[r].tap_filename;
+
+        if (filename == NULL)
+            continue;
+        const uint64_t max_frames = get_max_render_frames(options, buffer_size, sample_rate,
+                                                          (uint64_t)preroll + latency - outputs[r].offset);
+
+        outputs[r].writer = kuriborosu_writer_open(filename, options->writer_mode, 2, sample_rate, max_frames);
+
+        if (outputs[r].writer == NULL)
         {
-            kuri->plugin_needs_idle = false;
-            kuri->plugin_descriptor->dispatcher(kuri->plugin_handle, NATIVE_PLUGIN_OPCODE_IDLE, 0, 0, NULL, 0.0f);
+            ok = false;
+            goto close;
         }
 
-        // move BBT forwards
-        double newtick = kuri->time.bbt.tick
-             + (buffer_size * kuri->time.bbt.ticksPerBeat * kuri->time.bbt.beatsPerMinute / (sample_rate * 60));
+        if (options->normalize &&
+            ! kuriborosu_writer_enable_normalize(outputs[r].writer, options->normalize_lufs,
+                                                 options->normalize_true_peak))
+        {
+            ok = false;
+            goto close;
+        }
+    }
 
-        while (newtick >= kuri->time.bbt.ticksPerBeat)
+    // controller and program state of a MIDI input file is not sent by the player when starting mid-file
+    if (kuri->chase_rack != 0 && seek != 0)
+    {
+        if (! kuriborosu_midi_chase(kuri->chase_filename, (double)seek / sample_rate,
+                                    &kuri->chase_events, &kuri->chase_count))
         {
-            newtick -= kuri->time.bbt.ticksPerBeat;
+            ok = false;
+            goto close;
+        }
 
-            if (++kuri->time.bbt.beat > kuri->time.bbt.beatsPerBar)
-            {
-                ++kuri->time.bbt.bar;
-                kuri->time.bbt.beat = 1;
-                kuri->time.bbt.barStartTick += kuri->time.bbt.beatsPerBar * kuri->time.bbt.ticksPerBeat;
-            }
+        kuri->chase_pos = 0;
+        printf("chasing %u MIDI events\n", kuri->chase_count);
+    }
+
+    kuriborosu_telemetry_begin(stats.telemetry, "render_start");
+    kuriborosu_telemetry_add_uint(stats.telemetry, "start", options->start);
+    kuriborosu_telemetry_add_uint(stats.telemetry, "frames", options->frames);
+    kuriborosu_telemetry_add_uint(stats.telemetry, "preroll", preroll);
+    kuriborosu_telemetry_add_uint(stats.telemetry, "latency", latency);
+    kuriborosu_telemetry_add_uint(stats.telemetry, "outputs", kuri->rack_count);
+    kuriborosu_telemetry_add_uint(stats.telemetry, "chase_events", kuri->chase_count);
+    kuriborosu_telemetry_add_bool(stats.telemetry, "tail", options->tail_mode != tail_mode_none);
+    kuriborosu_telemetry_add_bool(stats.telemetry, "normalize", options->normalize);
+    kuriborosu_telemetry_end(stats.telemetry);
+
+    kuri->time.playing = true;
+    kuri->time.bbt.valid = true;
+    kuri->time.bbt.beatsPerBar    = 4;
+    kuri->time.bbt.beatType       = 4;
+    kuri->time.bbt.ticksPerBeat   = 1920;
+    kuri->time.bbt.beatsPerMinute = 120;
+
+    // render is extended by the chain latency, so the delayed end is not cut off
+    for (const uint64_t total = (uint64_t)preroll + options->frames + latency; pos < total; pos += buffer_size)
+    {
+        set_time_frame(kuri, seek + pos);
+
+        if (! process_racks(kuri, outputs, pos, &stats, bufN, bufA, bufB))
+        {
+            ok = false;
+            break;
         }
 
-        kuri->time.bbt.tick = newtick;
+        report_progress(kuri, outputs, &stats, pos < preroll ? "preroll" : "render", pos + buffer_size, total);
     }
 
-    if (options->tail_mode == tail_mode_continue_until_silence)
+    if (ok && options->tail_mode == tail_mode_continue_until_silence)
     {
         // keep going a bit until silence, maximum 5 seconds
         const uint32_t until_silence = 5 * sample_rate;
+        const char* reason = "limit";
+        uint32_t i = 0;
         kuri->time.playing = false;
 
-        for (uint32_t i = 0; i < until_silence; i += buffer_size)
+        kuriborosu_telemetry_begin(stats.telemetry, "tail");
+        kuriborosu_telemetry_add_string(stats.telemetry, "state", "start");
+        kuriborosu_telemetry_add_uint(stats.telemetry, "max_frames", until_silence);
+        kuriborosu_telemetry_end(stats.telemetry);
+
+        for (; i < until_silence; i += buffer_size, pos += buffer_size)
         {
-            memset(bufN, 0, sizeof(float)*buffer_size*2);
-            kuri->plugin_descriptor->process(kuri->plugin_handle, inbuf, outbuf, buffer_size, NULL, 0);
+            if (! process_racks(kuri, outputs, pos, &stats, bufN, bufA, bufB))
+            {
+                ok = false;
+                reason = "error";
+                break;
+            }
+
+            report_progress(kuri, outputs, &stats, "tail", i + buffer_size, until_silence);
 
-            // interleave
-            for (uint32_t j = 0, k = 0; k < buffer_size; j += 2, ++k)
+            if (fabsf(bufN[buffer_size-1]) < __FLT_EPSILON__)
             {
-                bufN[j+0] = bufL[k];
-                bufN[j+1] = bufR[k];
+                reason = "silence";
+                i += buffer_size;
+                pos += buffer_size;
+                break;
             }
+        }
 
-            sf_writef_float(file, bufN, buffer_size);
+        kuriborosu_telemetry_begin(stats.telemetry, "tail");
+        kuriborosu_telemetry_add_string(stats.telemetry, "state", "end");
+        kuriborosu_telemetry_add_uint(stats.telemetry, "frames", i);
+        kuriborosu_telemetry_add_string(stats.telemetry, "reason", reason);
+        kuriborosu_telemetry_end(stats.telemetry);
+    }
+
+close:
+    {
+        const double finalize_start = kuriborosu_telemetry_get_time(stats.telemetry);
 
-            if (kuri->plugin_needs_idle)
+        // taps follow the gain of the main output, so stems keep their balance against it
+        if (options->normalize)
+        {
+            const float gain = kuriborosu_writer_get_normalize_gain(outputs[kuri->rack_count - 1].writer);
+
+            for (uint32_t r = 0; r + 1 < kuri->rack_count; ++r)
             {
-                kuri->plugin_needs_idle = false;
-                kuri->plugin_descriptor->dispatcher(kuri->plugin_handle, NATIVE_PLUGIN_OPCODE_IDLE, 0, 0, NULL, 0.0f);
+                if (outputs[r].writer != NULL)
+                    kuriborosu_writer_set_normalize_gain(outputs[r].writer, gain);
             }
+        }
 
-            if (fabsf(bufN[buffer_size-1]) < __FLT_EPSILON__)
-                break;
+        for (uint32_t r = 0; r < kuri->rack_count; ++r)
+        {
+            if (outputs[r].writer != NULL && ! kuriborosu_writer_close(outputs[r].writer))
+                ok = false;
         }
+
+        const double end_time = kuriborosu_telemetry_get_time(stats.telemetry);
+
+        kuriborosu_telemetry_begin(stats.telemetry, "render_end");
+        kuriborosu_telemetry_add_bool(stats.telemetry, "ok", ok);
+        kuriborosu_telemetry_add_uint(stats.telemetry, "frames_rendered", pos);
+        kuriborosu_telemetry_add_double(stats.telemetry, "process_time", stats.process_time);
+        kuriborosu_telemetry_add_double(stats.telemetry, "write_time", stats.write_time);
+        kuriborosu_telemetry_add_double(stats.telemetry, "finalize_time", end_time - finalize_start);
+        kuriborosu_telemetry_add_double(stats.telemetry, "total_time", end_time - stats.start_time);
+        kuriborosu_telemetry_add_double(stats.telemetry, "realtime_factor",
+                                        end_time > stats.start_time
+                                        ? pos / (double)sample_rate / (end_time - stats.start_time) : 0.0);
+        kuriborosu_telemetry_end(stats.telemetry);
     }
 
+    free(kuri->chase_events);
+    kuri->chase_events = NULL;
+    kuri->chase_count = kuri->chase_pos = 0;
+
 free:
     free(bufN);
-    free(bufL);
-    free(bufR);
-    sf_close(file);
+    free(bufA);
+    free(bufB);
+    free(outputs);
 
-    return true;
+    return ok;
 }
 
 double get_file_length_from_last_plugin(Kuriborosu* const kuri)
@@ -449,23 +848,24 @@ double get_file_length_from_last_plugin(Kuriborosu* const kuri)
     static const double fallback = 60.0;
     CARLA_SAFE_ASSERT_RETURN(kuri != NULL, fallback);
 
-    const uint32_t next_plugin_id = carla_get_current_plugin_count(kuri->carla_handle);
+    const CarlaHostHandle carla_handle = get_last_carla_handle(kuri);
+    const uint32_t next_plugin_id = carla_get_current_plugin_count(carla_handle);
     CARLA_SAFE_ASSERT_RETURN(next_plugin_id != 0, fallback);
 
     const uint32_t plugin_id = next_plugin_id - 1;
-    const char* const plugin_name = carla_get_real_plugin_name(kuri->carla_handle, plugin_id);
+    const char* const plugin_name = carla_get_real_plugin_name(carla_handle, plugin_id);
     CARLA_SAFE_ASSERT_RETURN(plugin_name != NULL, fallback);
 
     if (strcmp(plugin_name, "Audio File") == 0 || strcmp(plugin_name, "MIDI File") == 0)
     {
-        const uint32_t parameter_count = carla_get_parameter_count(kuri->carla_handle, plugin_id);
+        const uint32_t parameter_count = carla_get_parameter_count(carla_handle, plugin_id);
 
         for (uint32_t i=0; i<parameter_count; ++i)
         {
-            const CarlaParameterInfo* const info = carla_get_parameter_info(kuri->carla_handle, plugin_id, i);
+            const CarlaParameterInfo* const info = carla_get_parameter_info(carla_handle, plugin_id, i);
 
             if (strcmp(info->name, "Length") == 0)
-                return carla_get_current_parameter_value(kuri->carla_handle, plugin_id, i);
+                return carla_get_current_parameter_value(carla_handle, plugin_id, i);
         }
     }
 
@@ -18,6 +18,8 @@
 #pragma once
 
 #include "CarlaNativePlugin.h"
+#include "telemetry.h"
+#include "writer.h"
 
 typedef struct _Kuriborosu Kuriborosu;
 
@@ -32,16 +34,33 @@ typedef enum tail_mode_t {
 
 typedef struct FILE_RENDER_OPTIONS_T {
     const char* filename;
+    // input position to start from, and number of frames to write from there
+    uint32_t start;
     uint32_t frames;
+    // frames rendered before start with their output discarded, so plugin state settles
+    uint32_t preroll;
     tail_mode_t tail_mode;
+    writer_mode_t writer_mode;
+    // normalize the main output file to normalize_lufs, with a true-peak limiter at normalize_true_peak dBTP.
+    // taps get the same gain as the main output, each limited against its own true peak
+    bool normalize;
+    float normalize_lufs;
+    float normalize_true_peak;
+    // optional progress and timing events, can be NULL
+    KuriborosuTelemetry* telemetry;
 } file_render_options_t;
 
 Kuriborosu* kuriborosu_host_init(uint32_t buffer_size, uint32_t sample_rate);
 void kuriborosu_host_destroy(Kuriborosu* kuri);
 
+// chase controller state of a MIDI input file when rendering from a later position,
+// must be called before loading the file and only when a seek will happen, as it adds a rack after the file
+void kuriborosu_host_enable_midi_chase(Kuriborosu* kuri, bool enabled);
 bool kuriborosu_host_load_file(Kuriborosu* kuri, const char* filename);
 bool kuriborosu_host_load_plugin(Kuriborosu* kuri, const char* filenameOrUID);
 bool kuriborosu_host_set_plugin_custom_data(Kuriborosu* kuri, const char* type, const char* key, const char* value);
+// write the output of all plugins loaded so far to a separate file, during the same render
+bool kuriborosu_host_add_tap(Kuriborosu* kuri, const char* filename);
 bool kuriborosu_host_render_to_file(Kuriborosu* kuri, const file_render_options_t* options);
 
 double get_file_length_from_last_plugin(Kuriborosu* kuri);
@@ -22,40 +22,182 @@
 #include <stdlib.h>
 #include <string.h>
 
+static void print_help()
+{
+    printf("Usage: kuriborosu [OPTIONS] [INFILE|NUMSECONDS] OUTFILE PLUGIN1 PLUGIN2... etc\n"
+           "Where the first argument can be a filename for input file, or number of seconds to render (useful for self-generators).\n"
+           "Plugins can be followed by '-p FILE' to set a plugin-specific file, or '-t FILE' to also write the output\n"
+           "of the chain up to that point into FILE (in the same render pass).\n\n"
+           "  --writer=MODE       Output writer, one of:\n"
+           "                        sndfile  regular libsndfile appends (default)\n"
+           "                        mmap     preallocate the output file and write through a memory mapping\n"
+           "                        direct   preallocate the output file and write aligned blocks with O_DIRECT\n"
+           "  --normalize=LUFS    Normalize output to LUFS integrated loudness, without running the plugins twice\n"
+           "                      taps get the same gain as the output, so they keep their relative level\n"
+           "  --true-peak=DBTP    True-peak ceiling used for normalization, defaults to -1 dBTP\n"
+           "  --start=SECONDS     Start rendering from this input position\n"
+           "  --end=SECONDS       Stop rendering at this input position, without a tail\n"
+           "  --preroll=SECONDS   Time rendered before the start position with its output discarded, defaults to 2\n"
+           "  --telemetry=TARGET  Write JSON-lines progress and timing events to TARGET, one of:\n"
+           "                        fd:NUMBER  an already open file descriptor, should be non-blocking\n"
+           "                        file:PATH  append to a file\n"
+           "                        unix:PATH  connect to a unix socket\n"
+           "  --help              Display this help and exit\n"
+           "  --version           Display version information and exit\n");
+}
+
+// seconds must be non-negative and fit in a 32-bit frame count at the given sample rate
+static bool parse_seconds(const char* const value, const uint32_t sample_rate, double* const seconds)
+{
+    char* end;
+    *seconds = strtod(value, &end);
+    return end != value && *end == '\0' && *seconds >= 0.0 && *seconds * sample_rate + 0.5 < (double)UINT32_MAX;
+}
+
+static void report_load(KuriborosuTelemetry* const telemetry, const char* const kind, const char* const name,
+                        const bool ok, const double start_time)
+{
+    kuriborosu_telemetry_begin(telemetry, "load");
+    kuriborosu_telemetry_add_string(telemetry, "kind", kind);
+    kuriborosu_telemetry_add_string(telemetry, "name", name);
+    kuriborosu_telemetry_add_bool(telemetry, "ok", ok);
+    kuriborosu_telemetry_add_double(telemetry, "duration", kuriborosu_telemetry_get_time(telemetry) - start_time);
+    kuriborosu_telemetry_end(telemetry);
+}
+
 int main(int argc, char* argv[])
 {
     // TODO use more advanced opts
     uint32_t opts_buffer_size = 256;
     uint32_t opts_sample_rate = 48000;
+    writer_mode_t opts_writer_mode = writer_mode_sndfile;
+    bool opts_normalize = false;
+    float opts_normalize_lufs = 0.0f;
+    float opts_normalize_true_peak = -1.0f;
+    double opts_start = 0.0;
+    double opts_end = -1.0;
+    double opts_preroll = 2.0;
+    const char* opts_telemetry = NULL;
 
-    if (argc >= 2 && strcmp(argv[1], "--version") == 0)
+    int argi = 1;
+
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; ++argi)
     {
-        printf("kuriborosu v0.0.0, using Carla v" CARLA_VERSION_STRING "\n"
-               "Copyright 2021-2023 Filipe Coelho <falktx@falktx.com>\n"
-               "License: ???\n"
-               "This is free software: you are free to change and redistribute it.\n"
-               "There is NO WARRANTY, to the extent permitted by law.\n");
-        return EXIT_SUCCESS;
+        const char* const arg = argv[argi];
+
+        if (strcmp(arg, "--version") == 0)
+        {
+            printf("kuriborosu v0.0.0, using Carla v" CARLA_VERSION_STRING "\n"
+                   "Copyright 2021-2023 Filipe Coelho <falktx@falktx.com>\n"
+                   "License: ???\n"
+                   "This is free software: you are free to change and redistribute it.\n"
+                   "There is NO WARRANTY, to the extent permitted by law.\n");
+            return EXIT_SUCCESS;
+        }
+
+        if (strcmp(arg, "--help") == 0)
+        {
+            print_help();
+            return EXIT_SUCCESS;
+        }
+
+        if (strncmp(arg, "--writer=", 9) == 0)
+        {
+            if (! kuriborosu_writer_mode_from_string(arg + 9, &opts_writer_mode))
+            {
+                fprintf(stderr, "Invalid writer mode '%s'\n", arg + 9);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--normalize=", 12) == 0)
+        {
+            char* end;
+            opts_normalize = true;
+            opts_normalize_lufs = strtof(arg + 12, &end);
+
+            if (end == arg + 12 || *end != '\0' || opts_normalize_lufs >= 0.0f)
+            {
+                fprintf(stderr, "Invalid normalization target '%s'\n", arg + 12);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--true-peak=", 12) == 0)
+        {
+            char* end;
+            opts_normalize_true_peak = strtof(arg + 12, &end);
+
+            if (end == arg + 12 || *end != '\0' || opts_normalize_true_peak > 0.0f)
+            {
+                fprintf(stderr, "Invalid true-peak ceiling '%s'\n", arg + 12);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--start=", 8) == 0)
+        {
+            if (! parse_seconds(arg + 8, opts_sample_rate, &opts_start))
+            {
+                fprintf(stderr, "Invalid start position '%s'\n", arg + 8);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--end=", 6) == 0)
+        {
+            if (! parse_seconds(arg + 6, opts_sample_rate, &opts_end))
+            {
+                fprintf(stderr, "Invalid end position '%s'\n", arg + 6);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--preroll=", 10) == 0)
+        {
+            if (! parse_seconds(arg + 10, opts_sample_rate, &opts_preroll))
+            {
+                fprintf(stderr, "Invalid pre-roll '%s'\n", arg + 10);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(arg, "--telemetry=", 12) == 0)
+        {
+            opts_telemetry = arg + 12;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option '%s'\n", arg);
+            return EXIT_FAILURE;
+        }
     }
 
-    if (argc < 4 || strcmp(argv[1], "--help") == 0)
+    if (argc - argi < 3)
     {
-        printf("Usage: kuriborosu [INFILE|NUMSECONDS] OUTFILE PLUGIN1 PLUGIN2... etc\n"
-                "Where the first argument can be a filename for input file, or number of seconds to render (useful for self-generators).\n\n"
-                "  --help       Display this help and exit\n"
-                "  --version    Display version information and exit\n");
+        print_help();
         return EXIT_SUCCESS;
     }
 
-    const char* infile = argv[1];
-    const char* outwav = argv[2];
+    const char* infile = argv[argi];
+    const char* outwav = argv[argi + 1];
+
+    KuriborosuTelemetry* telemetry = NULL;
+
+    if (opts_telemetry != NULL && (telemetry = kuriborosu_telemetry_open(opts_telemetry)) == NULL)
+        return EXIT_FAILURE;
+
+    kuriborosu_telemetry_begin(telemetry, "job_start");
+    kuriborosu_telemetry_add_string(telemetry, "input", infile);
+    kuriborosu_telemetry_add_string(telemetry, "output", outwav);
+    kuriborosu_telemetry_add_uint(telemetry, "sample_rate", opts_sample_rate);
+    kuriborosu_telemetry_add_uint(telemetry, "buffer_size", opts_buffer_size);
+    kuriborosu_telemetry_end(telemetry);
 
     Kuriborosu* const kuri = kuriborosu_host_init(opts_buffer_size, opts_sample_rate);
 
     if (kuri == NULL)
-        return EXIT_FAILURE;
+        goto error;
+
+    // a MIDI input file only needs its own rack when the transport does not start from zero
+    kuriborosu_host_enable_midi_chase(kuri, opts_start > opts_preroll);
 
     uint32_t file_frames;
+    double load_start;
 
     // Check if input file argument is actually seconds
     // FIXME some isalpha() check??
@@ -63,7 +205,11 @@ int main(int argc, char* argv[])
     if (isfile)
     {
         printf("loading file '%s'...\n", infile);
-        if (! kuriborosu_host_load_file(kuri, infile))
+        load_start = kuriborosu_telemetry_get_time(telemetry);
+        const bool loaded = kuriborosu_host_load_file(kuri, infile);
+        report_load(telemetry, "file", infile, loaded, load_start);
+
+        if (! loaded)
             goto error;
 
         file_frames = (uint32_t)(get_file_length_from_last_plugin(kuri) * opts_sample_rate + 0.5);
@@ -82,13 +228,23 @@ int main(int argc, char* argv[])
         file_frames = (uint32_t)seconds * opts_sample_rate;
     }
 
-    if (file_frames > 60*60*opts_sample_rate)
+    // optional time range within the input
+    const uint32_t start_frame = (uint32_t)(opts_start * opts_sample_rate + 0.5);
+    const uint32_t end_frame = opts_end >= 0.0 ? (uint32_t)(opts_end * opts_sample_rate + 0.5) : file_frames;
+
+    if (start_frame >= end_frame)
+    {
+        fprintf(stderr, "Invalid time range, start must be before end\n");
+        goto error;
+    }
+
+    if (end_frame - start_frame > 60*60*opts_sample_rate)
     {
         fprintf(stderr, "Output file unexpectedly big, bailing out\n");
         goto error;
     }
 
-    for (int i = 3; i < argc; ++i)
+    for (int i = argi + 2; i < argc; ++i)
     {
         const char* const plugin_arg = argv[i];
         printf("%d %s\n", i, plugin_arg);
@@ -97,7 +253,8 @@ int main(int argc, char* argv[])
         if (plugin_arg[0] == '.' || plugin_arg[0] == '/')
         {
             printf("loading file as plugin '%s'...\n", plugin_arg);
-            kuriborosu_host_load_file(kuri, plugin_arg);
+            load_start = kuriborosu_telemetry_get_time(telemetry);
+            report_load(telemetry, "file", plugin_arg, kuriborosu_host_load_file(kuri, plugin_arg), load_start);
         }
         // check if argument
         else if (plugin_arg[0] == '-')
@@ -112,6 +269,18 @@ int main(int argc, char* argv[])
                     kuriborosu_host_set_plugin_custom_data(kuri, CUSTOM_DATA_TYPE_PATH, "file", argv[i]);
                 }
                 break;
+            case 't':
+                if (++i < argc)
+                {
+                    printf("adding tap '%s'...\n", argv[i]);
+                    load_start = kuriborosu_telemetry_get_time(telemetry);
+                    const bool added = kuriborosu_host_add_tap(kuri, argv[i]);
+                    report_load(telemetry, "tap", argv[i], added, load_start);
+
+                    if (! added)
+                        goto error;
+                }
+                break;
             default:
                 // TODO give error
                 break;
@@ -120,21 +289,42 @@ int main(int argc, char* argv[])
         else
         {
             printf("loading plugin '%s'...\n", plugin_arg);
-            kuriborosu_host_load_plugin(kuri, plugin_arg);
+            load_start = kuriborosu_telemetry_get_time(telemetry);
+            report_load(telemetry, "plugin", plugin_arg, kuriborosu_host_load_plugin(kuri, plugin_arg), load_start);
         }
     }
 
     const file_render_options_t options = {
         .filename = outwav,
-        .frames = file_frames,
-        .tail_mode = isfile ? tail_mode_continue_until_silence : tail_mode_none,
+        .start = start_frame,
+        .frames = end_frame - start_frame,
+        .preroll = (uint32_t)(opts_preroll * opts_sample_rate + 0.5),
+        .tail_mode = isfile && opts_end < 0.0 ? tail_mode_continue_until_silence : tail_mode_none,
+        .writer_mode = opts_writer_mode,
+        .normalize = opts_normalize,
+        .normalize_lufs = opts_normalize_lufs,
+        .normalize_true_peak = opts_normalize_true_peak,
+        .telemetry = telemetry,
     };
-    kuriborosu_host_render_to_file(kuri, &options);
+
+    if (! kuriborosu_host_render_to_file(kuri, &options))
+        goto error;
 
     kuriborosu_host_destroy(kuri);
+
+    kuriborosu_telemetry_begin(telemetry, "job_end");
+    kuriborosu_telemetry_add_bool(telemetry, "ok", true);
+    kuriborosu_telemetry_end(telemetry);
+    kuriborosu_telemetry_close(telemetry);
     return EXIT_SUCCESS;
 
 error:
-    kuriborosu_host_destroy(kuri);
+    if (kuri != NULL)
+        kuriborosu_host_destroy(kuri);
+
+    kuriborosu_telemetry_begin(telemetry, "job_end");
+    kuriborosu_telemetry_add_bool(telemetry, "ok", false);
+    kuriborosu_telemetry_end(telemetry);
+    kuriborosu_telemetry_close(telemetry);
     return EXIT_FAILURE;
 }
@@ -0,0 +1,481 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#include "loudness.h"
+
+#include <math.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+// --------------------------------------------------------------------------------------------------------------------
+// true peak, 4x oversampling using the interpolation filter from ITU-R BS.1770-4 Annex 2
+
+#define TRUE_PEAK_TAPS 12
+#define TRUE_PEAK_PHASES 4
+// group delay of the interpolation filter, in input samples
+#define TRUE_PEAK_DELAY 6
+
+static const float kTruePeakCoefficients[TRUE_PEAK_PHASES][TRUE_PEAK_TAPS] = {
+    {  0.0017089843750f,  0.0109863281250f, -0.0196533203125f,  0.0332031250000f,
+      -0.0594482421875f,  0.1373291015625f,  0.9721679687500f, -0.1022949218750f,
+       0.0476074218750f, -0.0266113281250f,  0.0148925781250f, -0.0083007812500f },
+    { -0.0291748046875f,  0.0292968750000f, -0.0517578125000f,  0.0891113281250f,
+      -0.1665039062500f,  0.4650878906250f,  0.7797851562500f, -0.2003173828125f,
+       0.1015625000000f, -0.0582275390625f,  0.0330810546875f, -0.0189208984375f },
+    { -0.0189208984375f,  0.0330810546875f, -0.0582275390625f,  0.1015625000000f,
+      -0.2003173828125f,  0.7797851562500f,  0.4650878906250f, -0.1665039062500f,
+       0.0891113281250f, -0.0517578125000f,  0.0292968750000f, -0.0291748046875f },
+    { -0.0083007812500f,  0.0148925781250f, -0.0266113281250f,  0.0476074218750f,
+      -0.1022949218750f,  0.9721679687500f,  0.1373291015625f, -0.0594482421875f,
+       0.0332031250000f, -0.0196533203125f,  0.0109863281250f,  0.0017089843750f },
+};
+
+typedef struct TRUE_PEAK_STATE_T {
+    // history is stored twice so the last TRUE_PEAK_TAPS samples are always contiguous
+    float history[TRUE_PEAK_TAPS * 2];
+    uint32_t pos;
+} true_peak_state_t;
+
+static float true_peak_process(true_peak_state_t* const state, const float sample)
+{
+    state->history[state->pos] = state->history[state->pos + TRUE_PEAK_TAPS] = sample;
+
+    // newest sample is at pos + TRUE_PEAK_TAPS, oldest at pos + 1
+    const float* const newest = state->history + state->pos + TRUE_PEAK_TAPS;
+    float peak = 0.0f;
+
+    for (uint32_t p = 0; p < TRUE_PEAK_PHASES; ++p)
+    {
+        float acc = 0.0f;
+
+        for (uint32_t k = 0; k < TRUE_PEAK_TAPS; ++k)
+            acc += kTruePeakCoefficients[p][k] * newest[-(int)k];
+
+        if (fabsf(acc) > peak)
+            peak = fabsf(acc);
+    }
+
+    if (++state->pos == TRUE_PEAK_TAPS)
+        state->pos = 0;
+
+    return peak;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// loudness meter
+
+typedef struct BIQUAD_T {
+    double b0, b1, b2, a1, a2;
+} biquad_t;
+
+typedef struct _KuriborosuLoudnessMeter {
+    uint32_t channels;
+    // K-weighting, high-shelf followed by high-pass
+    biquad_t shelf;
+    biquad_t highpass;
+    // 4 filter state values per channel, 2 per biquad
+    double* filter_state;
+    true_peak_state_t* true_peak;
+    double true_peak_max;
+    // energy of 100ms sub-blocks, 4 of them make up one 400ms gating block
+    uint32_t subblock_frames;
+    uint32_t subblock_pos;
+    double subblock_sum;
+    double subblocks[4];
+    uint64_t subblock_count;
+    // mean square of each gating block
+    double* blocks;
+    size_t block_count;
+    size_t block_capacity;
+} KuriborosuLoudnessMeter;
+
+static inline double biquad_process(const biquad_t* const bq, double* const z, const double x)
+{
+    // transposed direct form II
+    const double y = bq->b0 * x + z[0];
+    z[0] = bq->b1 * x - bq->a1 * y + z[1];
+    z[1] = bq->b2 * x - bq->a2 * y;
+    return y;
+}
+
+static double energy_to_lufs(const double energy)
+{
+    return -0.691 + 10.0 * log10(energy);
+}
+
+KuriborosuLoudnessMeter* kuriborosu_loudness_meter_create(const uint32_t channels, const uint32_t sample_rate)
+{
+    KuriborosuLoudnessMeter* const meter = (KuriborosuLoudnessMeter*)calloc(1, sizeof(KuriborosuLoudnessMeter));
+
+    if (meter == NULL)
+        return NULL;
+
+    meter->channels = channels;
+    meter->filter_state = (double*)calloc(channels * 4, sizeof(double));
+    meter->true_peak = (true_peak_state_t*)calloc(channels, sizeof(true_peak_state_t));
+    meter->subblock_frames = sample_rate / 10;
+
+    if (meter->filter_state == NULL || meter->true_peak == NULL)
+    {
+        kuriborosu_loudness_meter_destroy(meter);
+        return NULL;
+    }
+
+    // K-weighting filter coefficients for arbitrary sample rates, derived from the 48kHz ones in BS.1770
+    {
+        const double f0 = 1681.974450955533;
+        const double G  = 3.999843853973347;
+        const double Q  = 0.7071752369554196;
+        const double K  = tan(M_PI * f0 / sample_rate);
+        const double Vh = pow(10.0, G / 20.0);
+        const double Vb = pow(Vh, 0.4996667741545416);
+        const double a0 = 1.0 + K / Q + K * K;
+
+        meter->shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+        meter->shelf.b1 = 2.0 * (K * K - Vh) / a0;
+        meter->shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+        meter->shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+        meter->shelf.a2 = (1.0 - K / Q + K * K) / a0;
+    }
+    {
+        const double f0 = 38.13547087602444;
+        const double Q  = 0.5003270373238773;
+        const double K  = tan(M_PI * f0 / sample_rate);
+        const double a0 = 1.0 + K / Q + K * K;
+
+        meter->highpass.b0 = 1.0;
+        meter->highpass.b1 = -2.0;
+        meter->highpass.b2 = 1.0;
+        meter->highpass.a1 = 2.0 * (K * K - 1.0) / a0;
+        meter->highpass.a2 = (1.0 - K / Q + K * K) / a0;
+    }
+
+    return meter;
+}
+
+void kuriborosu_loudness_meter_destroy(KuriborosuLoudnessMeter* const meter)
+{
+    if (meter == NULL)
+        return;
+
+    free(meter->filter_state);
+    free(meter->true_peak);
+    free(meter->blocks);
+    free(meter);
+}
+
+bool kuriborosu_loudness_meter_process(KuriborosuLoudnessMeter* const meter, const float* const interleaved,
+                                       const uint32_t frames)
+{
+    const uint32_t channels = meter->channels;
+
+    for (uint32_t i = 0; i < frames; ++i)
+    {
+        const float* const frame = interleaved + i * channels;
+
+        for (uint32_t c = 0; c < channels; ++c)
+        {
+            double* const z = meter->filter_state + c * 4;
+            const double y = biquad_process(&meter->highpass, z + 2, biquad_process(&meter->shelf, z, frame[c]));
+            meter->subblock_sum += y * y;
+
+            const double peak = true_peak_process(&meter->true_peak[c], frame[c]);
+            if (peak > meter->true_peak_max)
+                meter->true_peak_max = peak;
+        }
+
+        if (++meter->subblock_pos != meter->subblock_frames)
+            continue;
+
+        meter->subblocks[meter->subblock_count++ % 4] = meter->subblock_sum;
+        meter->subblock_pos = 0;
+        meter->subblock_sum = 0.0;
+
+        // 400ms blocks with 75% overlap
+        if (meter->subblock_count < 4)
+            continue;
+
+        if (meter->block_count == meter->block_capacity)
+        {
+            const size_t capacity = meter->block_capacity != 0 ? meter->block_capacity * 2 : 1024;
+            double* const blocks = (double*)realloc(meter->blocks, sizeof(double) * capacity);
+
+            if (blocks == NULL)
+                return false;
+
+            meter->blocks = blocks;
+            meter->block_capacity = capacity;
+        }
+
+        meter->blocks[meter->block_count++] = (meter->subblocks[0] + meter->subblocks[1]
+                                              + meter->subblocks[2] + meter->subblocks[3])
+                                            / (4.0 * meter->subblock_frames);
+    }
+
+    return true;
+}
+
+double kuriborosu_loudness_meter_get_integrated(const KuriborosuLoudnessMeter* const meter)
+{
+    // absolute gate at -70 LUFS
+    const double absolute_gate = pow(10.0, (-70.0 + 0.691) / 10.0);
+    double sum = 0.0;
+    size_t count = 0;
+
+    for (size_t i = 0; i < meter->block_count; ++i)
+    {
+        if (meter->blocks[i] > absolute_gate)
+        {
+            sum += meter->blocks[i];
+            ++count;
+        }
+    }
+
+    if (count == 0)
+        return -HUGE_VAL;
+
+    // relative gate at -10 LU from the absolute-gated loudness
+    const double relative_gate = sum / count * 0.1;
+    const double gate = relative_gate > absolute_gate ? relative_gate : absolute_gate;
+    sum = 0.0;
+    count = 0;
+
+    for (size_t i = 0; i < meter->block_count; ++i)
+    {
+        if (meter->blocks[i] > gate)
+        {
+            sum += meter->blocks[i];
+            ++count;
+        }
+    }
+
+    if (count == 0)
+        return -HUGE_VAL;
+
+    return energy_to_lufs(sum / count);
+}
+
+double kuriborosu_loudness_meter_get_true_peak(const KuriborosuLoudnessMeter* const meter)
+{
+    return meter->true_peak_max;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// limiter
+//
+// the gain needed to keep each true peak under the ceiling goes through a sliding minimum over the lookahead window,
+// then a moving average over half of it, so gain reduction ramps in smoothly but is always fully applied by the time
+// the delayed peak reaches the output. release is a simple one-pole smoother.
+
+typedef struct _KuriborosuLimiter {
+    uint32_t channels;
+    float gain;
+    float ceiling;
+    true_peak_state_t* true_peak;
+    uint32_t window;
+    uint32_t average;
+    uint32_t latency;
+    // sliding minimum, monotonic queue over the last window frames
+    float* min_values;
+    uint64_t* min_positions;
+    uint32_t min_head;
+    uint32_t min_count;
+    // moving average of the sliding minimum
+    float* avg_values;
+    double avg_sum;
+    float release;
+    float envelope;
+    // audio delay line, latency frames
+    float* delay;
+    uint64_t position;
+} KuriborosuLimiter;
+
+KuriborosuLimiter* kuriborosu_limiter_create(const uint32_t channels, const uint32_t sample_rate,
+                                             const float gain, const float ceiling)
+{
+    KuriborosuLimiter* const limiter = (KuriborosuLimiter*)calloc(1, sizeof(KuriborosuLimiter));
+
+    if (limiter == NULL)
+        return NULL;
+
+    // 5ms lookahead, kept even
+    uint32_t window = sample_rate / 200;
+    if (window < 8)
+        window = 8;
+    window &= ~1u;
+
+    limiter->channels = channels;
+    limiter->gain = gain;
+    limiter->ceiling = ceiling;
+    limiter->window = window;
+    limiter->average = window / 2;
+    // align the delayed peak with the middle of the range where the averaged gain is fully reduced
+    limiter->latency = TRUE_PEAK_DELAY + (limiter->window + limiter->average) / 2 - 1;
+    // 50ms release
+    limiter->release = 1.0f - expf(-1.0f / (0.05f * sample_rate));
+    limiter->envelope = 1.0f;
+
+    limiter->true_peak = (true_peak_state_t*)calloc(channels, sizeof(true_peak_state_t));
+    limiter->min_values = (float*)calloc(window, sizeof(float));
+    limiter->min_positions = (uint64_t*)calloc(window, sizeof(uint64_t));
+    limiter->avg_values = (float*)calloc(limiter->average, sizeof(float));
+    limiter->delay = (float*)calloc(limiter->latency * channels, sizeof(float));
+
+    if (limiter->true_peak == NULL || limiter->min_values == NULL || limiter->min_positions == NULL
+        || limiter->avg_values == NULL || limiter->delay == NULL)
+    {
+        kuriborosu_limiter_destroy(limiter);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < limiter->average; ++i)
+        limiter->avg_values[i] = 1.0f;
+
+    limiter->avg_sum = limiter->average;
+
+    return limiter;
+}
+
+void kuriborosu_limiter_destroy(KuriborosuLimiter* const limiter)
+{
+    if (limiter == NULL)
+        return;
+
+    free(limiter->true_peak);
+    free(limiter->min_values);
+    free(limiter->min_positions);
+    free(limiter->avg_values);
+    free(limiter->delay);
+    free(limiter);
+}
+
+uint32_t kuriborosu_limiter_get_latency(const KuriborosuLimiter* const limiter)
+{
+    return limiter->latency;
+}
+
+// returns true if a frame was written into out
+static bool limiter_process_frame(KuriborosuLimiter* const limiter, const float* const in, float* const out)
+{
+    const uint32_t channels = limiter->channels;
+    const uint64_t pos = limiter->position++;
+
+    float peak = 0.0f;
+
+    for (uint32_t c = 0; c < channels; ++c)
+    {
+        const float p = true_peak_process(&limiter->true_peak[c], in[c] * limiter->gain);
+        if (p > peak)
+            peak = p;
+    }
+
+    const float required = peak > limiter->ceiling ? limiter->ceiling / peak : 1.0f;
+
+    // sliding minimum, expire old entries first so the ring never holds more than window values
+    while (limiter->min_count != 0 && limiter->min_positions[limiter->min_head] + limiter->window <= pos)
+    {
+        limiter->min_head = (limiter->min_head + 1) % limiter->window;
+        --limiter->min_count;
+    }
+
+    while (limiter->min_count != 0)
+    {
+        const uint32_t back = (limiter->min_head + limiter->min_count - 1) % limiter->window;
+
+        if (limiter->min_values[back] < required)
+            break;
+
+        --limiter->min_count;
+    }
+
+    {
+        const uint32_t back = (limiter->min_head + limiter->min_count) % limiter->window;
+        limiter->min_values[back] = required;
+        limiter->min_positions[back] = pos;
+        ++limiter->min_count;
+    }
+
+    // moving average
+    const float minimum = limiter->min_values[limiter->min_head];
+    float* const avg_value = &limiter->avg_values[pos % limiter->average];
+
+    limiter->avg_sum += minimum - *avg_value;
+    *avg_value = minimum;
+
+    float target = (float)(limiter->avg_sum / limiter->average);
+    if (target > 1.0f)
+        target = 1.0f;
+
+    // release
+    if (target < limiter->envelope)
+        limiter->envelope = target;
+    else
+        limiter->envelope += (target - limiter->envelope) * limiter->release;
+
+    // delay line
+    float* const delayed = limiter->delay + (pos % limiter->latency) * channels;
+    const bool valid = pos >= limiter->latency;
+
+    for (uint32_t c = 0; c < channels; ++c)
+    {
+        if (valid)
+            out[c] = delayed[c] * limiter->envelope;
+
+        delayed[c] = in[c] * limiter->gain;
+    }
+
+    return valid;
+}
+
+uint32_t kuriborosu_limiter_process(KuriborosuLimiter* const limiter, const float* const in, float* const out,
+                                    const uint32_t frames)
+{
+    const uint32_t channels = limiter->channels;
+    uint32_t written = 0;
+
+    for (uint32_t i = 0; i < frames; ++i)
+    {
+        if (limiter_process_frame(limiter, in + i * channels, out + written * channels))
+            ++written;
+    }
+
+    return written;
+}
+
+uint32_t kuriborosu_limiter_flush(KuriborosuLimiter* const limiter, float* const out)
+{
+    const uint32_t channels = limiter->channels;
+    // max channel count we care about, used only as silence input
+    const float silence[8] = { 0.0f };
+    uint32_t written = 0;
+
+    if (channels > sizeof(silence)/sizeof(silence[0]))
+        return 0;
+
+    for (uint32_t i = 0; i < limiter->latency; ++i)
+    {
+        if (limiter_process_frame(limiter, silence, out + written * channels))
+            ++written;
+    }
+
+    return written;
+}
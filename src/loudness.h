@@ -0,0 +1,42 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _KuriborosuLoudnessMeter KuriborosuLoudnessMeter;
+typedef struct _KuriborosuLimiter KuriborosuLimiter;
+
+// ITU-R BS.1770 integrated loudness and true peak meter, all channels use a weight of 1.0
+KuriborosuLoudnessMeter* kuriborosu_loudness_meter_create(uint32_t channels, uint32_t sample_rate);
+void kuriborosu_loudness_meter_destroy(KuriborosuLoudnessMeter* meter);
+bool kuriborosu_loudness_meter_process(KuriborosuLoudnessMeter* meter, const float* interleaved, uint32_t frames);
+// returns -HUGE_VAL if everything was below the absolute gate
+double kuriborosu_loudness_meter_get_integrated(const KuriborosuLoudnessMeter* meter);
+// linear value, not dBTP
+double kuriborosu_loudness_meter_get_true_peak(const KuriborosuLoudnessMeter* meter);
+
+// static gain followed by a lookahead true-peak limiter, ceiling is linear
+// output is delayed internally, process returns how many frames were written to out (never more than frames)
+// and flush must be called at the end with room for kuriborosu_limiter_get_latency() frames
+KuriborosuLimiter* kuriborosu_limiter_create(uint32_t channels, uint32_t sample_rate, float gain, float ceiling);
+void kuriborosu_limiter_destroy(KuriborosuLimiter* limiter);
+uint32_t kuriborosu_limiter_get_latency(const KuriborosuLimiter* limiter);
+uint32_t kuriborosu_limiter_process(KuriborosuLimiter* limiter, const float* in, float* out, uint32_t frames);
+uint32_t kuriborosu_limiter_flush(KuriborosuLimiter* limiter, float* out);
@@ -0,0 +1,614 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#include "midichase.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// per channel: 120 controllers (channel mode messages are not chased), program, channel pressure and pitch-bend
+// data entry and RPN/NRPN selection controllers are not chased on their own, but through chase_parameter_t
+#define CHASE_CONTROLLERS 120
+#define CHASE_SLOT_PROGRAM (CHASE_CONTROLLERS + 0)
+#define CHASE_SLOT_PRESSURE (CHASE_CONTROLLERS + 1)
+#define CHASE_SLOT_PITCHBEND (CHASE_CONTROLLERS + 2)
+#define CHASE_SLOTS_PER_CHANNEL (CHASE_CONTROLLERS + 3)
+#define CHASE_SLOTS (16 * CHASE_SLOTS_PER_CHANNEL)
+
+typedef struct CHASE_SLOT_T {
+    bool valid;
+    uint8_t size;
+    uint8_t data[3];
+    uint64_t tick;
+    // parse order, to keep events on the same tick in file order
+    uint64_t seq;
+} chase_slot_t;
+
+// value of a single RPN or NRPN, replayed as a complete select and data entry sequence
+typedef struct CHASE_PARAMETER_T {
+    uint8_t channel;
+    bool nrpn;
+    uint8_t msb;
+    uint8_t lsb;
+    // -1 if never set
+    int16_t data_msb;
+    int16_t data_lsb;
+    uint64_t tick;
+    uint64_t seq;
+} chase_parameter_t;
+
+// RPN/NRPN currently selected on a channel, 127/127 is the null parameter
+typedef struct PARAMETER_SELECTION_T {
+    bool nrpn;
+    uint8_t rpn[2];
+    uint8_t nrpn_select[2];
+} parameter_selection_t;
+
+typedef struct TEMPO_EVENT_T {
+    uint64_t tick;
+    uint32_t usecs_per_beat;
+} tempo_event_t;
+
+typedef struct SMF_T {
+    const uint8_t* data;
+    size_t size;
+    size_t header_size;
+    uint16_t division;
+    tempo_event_t* tempos;
+    size_t tempo_count;
+    size_t tempo_capacity;
+    chase_slot_t* slots;
+    chase_parameter_t* parameters;
+    size_t parameter_count;
+    size_t parameter_capacity;
+    uint64_t seq;
+} smf_t;
+
+static uint32_t read_u32_be(const uint8_t* const p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t read_u16_be(const uint8_t* const p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static bool read_vlq(const uint8_t** const p, const uint8_t* const end, uint32_t* const value)
+{
+    *value = 0;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        if (*p == end)
+            return false;
+
+        const uint8_t byte = *(*p)++;
+        *value = (*value << 7) | (byte & 0x7f);
+
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static bool add_tempo(smf_t* const smf, const uint64_t tick, const uint32_t usecs_per_beat)
+{
+    if (smf->tempo_count == smf->tempo_capacity)
+    {
+        const size_t capacity = smf->tempo_capacity != 0 ? smf->tempo_capacity * 2 : 16;
+        tempo_event_t* const tempos = (tempo_event_t*)realloc(smf->tempos, sizeof(tempo_event_t) * capacity);
+
+        if (tempos == NULL)
+            return false;
+
+        smf->tempos = tempos;
+        smf->tempo_capacity = capacity;
+    }
+
+    smf->tempos[smf->tempo_count].tick = tick;
+    smf->tempos[smf->tempo_count].usecs_per_beat = usecs_per_beat;
+    ++smf->tempo_count;
+    return true;
+}
+
+static void set_slot(smf_t* const smf, const uint32_t index, const uint64_t tick,
+                     const uint8_t status, const uint8_t data1, const uint8_t data2, const uint8_t size)
+{
+    chase_slot_t* const slot = &smf->slots[index];
+
+    // a later track can have an older value for the same slot
+    if (slot->valid && slot->tick > tick)
+        return;
+
+    slot->valid = true;
+    slot->size = size;
+    slot->data[0] = status;
+    slot->data[1] = data1;
+    slot->data[2] = data2;
+    slot->tick = tick;
+    slot->seq = smf->seq++;
+}
+
+static chase_parameter_t* get_parameter(smf_t* const smf, const uint8_t channel, const bool nrpn,
+                                        const uint8_t msb, const uint8_t lsb)
+{
+    for (size_t i = 0; i < smf->parameter_count; ++i)
+    {
+        chase_parameter_t* const parameter = &smf->parameters[i];
+
+        if (parameter->channel == channel && parameter->nrpn == nrpn && parameter->msb == msb && parameter->lsb == lsb)
+            return parameter;
+    }
+
+    if (smf->parameter_count == smf->parameter_capacity)
+    {
+        const size_t capacity = smf->parameter_capacity != 0 ? smf->parameter_capacity * 2 : 16;
+        chase_parameter_t* const parameters =
+            (chase_parameter_t*)realloc(smf->parameters, sizeof(chase_parameter_t) * capacity);
+
+        if (parameters == NULL)
+            return NULL;
+
+        smf->parameters = parameters;
+        smf->parameter_capacity = capacity;
+    }
+
+    chase_parameter_t* const parameter = &smf->parameters[smf->parameter_count++];
+    parameter->channel = channel;
+    parameter->nrpn = nrpn;
+    parameter->msb = msb;
+    parameter->lsb = lsb;
+    parameter->data_msb = parameter->data_lsb = -1;
+    parameter->tick = 0;
+    parameter->seq = 0;
+    return parameter;
+}
+
+// returns false on allocation failure, controllers that are not about parameters are left to the caller
+static bool set_parameter(smf_t* const smf, parameter_selection_t* const selection, const uint8_t channel,
+                          const uint64_t tick, const uint8_t controller, const uint8_t value, bool* const handled)
+{
+    *handled = true;
+
+    switch (controller)
+    {
+    case 101:
+    case 100:
+        selection->nrpn = false;
+        selection->rpn[controller == 101 ? 0 : 1] = value;
+        return true;
+    case 99:
+    case 98:
+        selection->nrpn = true;
+        selection->nrpn_select[controller == 99 ? 0 : 1] = value;
+        return true;
+    case 6:
+    case 38:
+    case 96:
+    case 97:
+        break;
+    default:
+        *handled = false;
+        return true;
+    }
+
+    const uint8_t* const selected = selection->nrpn ? selection->nrpn_select : selection->rpn;
+
+    // data entry without a selected parameter does nothing
+    if (selected[0] == 127 && selected[1] == 127)
+        return true;
+
+    chase_parameter_t* const parameter = get_parameter(smf, channel, selection->nrpn, selected[0], selected[1]);
+
+    if (parameter == NULL)
+        return false;
+
+    // a later track can have an older value for the same parameter
+    if (parameter->seq != 0 && parameter->tick > tick)
+        return true;
+
+    switch (controller)
+    {
+    case 6:
+        parameter->data_msb = value;
+        break;
+    case 38:
+        parameter->data_lsb = value;
+        break;
+    default:
+    {
+        // increment and decrement act on the full 14-bit value when there is one, on the MSB otherwise
+        if (parameter->data_msb < 0)
+            return true;
+
+        const bool fine = parameter->data_lsb >= 0;
+        int32_t data = fine ? (parameter->data_msb << 7) | parameter->data_lsb : parameter->data_msb;
+        const int32_t max = fine ? 0x3fff : 0x7f;
+
+        data += controller == 96 ? 1 : -1;
+        if (data < 0 || data > max)
+            return true;
+
+        parameter->data_msb = (int16_t)(fine ? data >> 7 : data);
+        if (fine)
+            parameter->data_lsb = (int16_t)(data & 0x7f);
+        break;
+    }
+    }
+
+    parameter->tick = tick;
+    parameter->seq = ++smf->seq;
+    return true;
+}
+
+// without slots only tempo events are collected, otherwise only channel events before seek_tick
+static bool parse_track(smf_t* const smf, const uint8_t* p, const uint8_t* const end, const double seek_tick)
+{
+    uint64_t tick = 0;
+    uint8_t running_status = 0;
+    parameter_selection_t selections[16];
+
+    for (int i = 0; i < 16; ++i)
+    {
+        selections[i].nrpn = false;
+        selections[i].rpn[0] = selections[i].rpn[1] = 127;
+        selections[i].nrpn_select[0] = selections[i].nrpn_select[1] = 127;
+    }
+
+    while (p < end)
+    {
+        uint32_t delta;
+        if (! read_vlq(&p, end, &delta))
+            return false;
+
+        tick += delta;
+
+        if (p == end)
+            return false;
+
+        uint8_t status = *p;
+
+        if (status & 0x80)
+            ++p;
+        else if (running_status != 0)
+            status = running_status;
+        else
+            return false;
+
+        // meta and sysex events
+        if (status >= 0xf0)
+        {
+            running_status = 0;
+            uint8_t type = 0;
+
+            if (status == 0xff)
+            {
+                if (p == end)
+                    return false;
+                type = *p++;
+            }
+            else if (status != 0xf0 && status != 0xf7)
+            {
+                return false;
+            }
+
+            uint32_t length;
+            if (! read_vlq(&p, end, &length) || length > (size_t)(end - p))
+                return false;
+
+            if (smf->slots == NULL && status == 0xff && type == 0x51 && length == 3)
+            {
+                if (! add_tempo(smf, tick, ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2]))
+                    return false;
+            }
+
+            p += length;
+            continue;
+        }
+
+        running_status = status;
+
+        const uint8_t type = status & 0xf0;
+        const uint8_t channel = status & 0x0f;
+        const uint8_t size = type == 0xc0 || type == 0xd0 ? 2 : 3;
+
+        if ((size_t)(end - p) < (size_t)(size - 1))
+            return false;
+
+        const uint8_t data1 = p[0] & 0x7f;
+        const uint8_t data2 = size == 3 ? p[1] & 0x7f : 0;
+        p += size - 1;
+
+        if (smf->slots == NULL || (double)tick >= seek_tick)
+            continue;
+
+        const uint32_t base = channel * CHASE_SLOTS_PER_CHANNEL;
+
+        switch (type)
+        {
+        case 0xb0:
+        {
+            bool handled;
+            if (! set_parameter(smf, &selections[channel], channel, tick, data1, data2, &handled))
+                return false;
+            if (! handled && data1 < CHASE_CONTROLLERS)
+                set_slot(smf, base + data1, tick, status, data1, data2, size);
+            break;
+        }
+        case 0xc0:
+            set_slot(smf, base + CHASE_SLOT_PROGRAM, tick, status, data1, data2, size);
+            break;
+        case 0xd0:
+            set_slot(smf, base + CHASE_SLOT_PRESSURE, tick, status, data1, data2, size);
+            break;
+        case 0xe0:
+            set_slot(smf, base + CHASE_SLOT_PITCHBEND, tick, status, data1, data2, size);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+static bool parse_tracks(smf_t* const smf, const double seek_tick)
+{
+    const uint8_t* p = smf->data + 8 + smf->header_size;
+    const uint8_t* const end = smf->data + smf->size;
+
+    while ((size_t)(end - p) >= 8)
+    {
+        const uint32_t length = read_u32_be(p + 4);
+
+        if (length > (size_t)(end - p) - 8)
+            return false;
+
+        if (memcmp(p, "MTrk", 4) == 0 && ! parse_track(smf, p + 8, p + 8 + length, seek_tick))
+            return false;
+
+        p += 8 + length;
+    }
+
+    return true;
+}
+
+static int compare_tempo(const void* const a, const void* const b)
+{
+    const tempo_event_t* const ta = (const tempo_event_t*)a;
+    const tempo_event_t* const tb = (const tempo_event_t*)b;
+    return ta->tick < tb->tick ? -1 : ta->tick > tb->tick ? 1 : 0;
+}
+
+static int compare_slot(const void* const a, const void* const b)
+{
+    const chase_slot_t* const sa = *(const chase_slot_t* const*)a;
+    const chase_slot_t* const sb = *(const chase_slot_t* const*)b;
+
+    if (sa->tick != sb->tick)
+        return sa->tick < sb->tick ? -1 : 1;
+
+    return sa->seq < sb->seq ? -1 : sa->seq > sb->seq ? 1 : 0;
+}
+
+static int compare_parameter(const void* const a, const void* const b)
+{
+    const chase_parameter_t* const pa = (const chase_parameter_t*)a;
+    const chase_parameter_t* const pb = (const chase_parameter_t*)b;
+
+    if (pa->tick != pb->tick)
+        return pa->tick < pb->tick ? -1 : 1;
+
+    return pa->seq < pb->seq ? -1 : pa->seq > pb->seq ? 1 : 0;
+}
+
+static void add_controller(NativeMidiEvent* const events, uint32_t* const count,
+                           const uint8_t channel, const uint8_t controller, const uint8_t value)
+{
+    NativeMidiEvent* const event = &events[(*count)++];
+    event->size = 3;
+    event->data[0] = 0xb0 | channel;
+    event->data[1] = controller;
+    event->data[2] = value;
+}
+
+static double seconds_to_ticks(smf_t* const smf, const double seconds)
+{
+    // SMPTE based division, fixed number of ticks per second
+    if (smf->division & 0x8000)
+    {
+        const int fps = -(int8_t)(smf->division >> 8);
+        return seconds * fps * (smf->division & 0xff);
+    }
+
+    if (smf->tempo_count != 0)
+        qsort(smf->tempos, smf->tempo_count, sizeof(tempo_event_t), compare_tempo);
+
+    const double ticks_per_beat = smf->division;
+    double time = 0.0;
+    uint64_t tick = 0;
+    uint32_t usecs_per_beat = 500000;
+
+    for (size_t i = 0; i < smf->tempo_count; ++i)
+    {
+        const double next = time + (smf->tempos[i].tick - tick) * usecs_per_beat / (1000000.0 * ticks_per_beat);
+
+        if (next > seconds)
+            break;
+
+        time = next;
+        tick = smf->tempos[i].tick;
+        usecs_per_beat = smf->tempos[i].usecs_per_beat;
+    }
+
+    return tick + (seconds - time) * 1000000.0 * ticks_per_beat / usecs_per_beat;
+}
+
+bool kuriborosu_midi_chase(const char* const filename, const double seconds,
+                           NativeMidiEvent** const events, uint32_t* const count)
+{
+    if (filename == NULL || events == NULL || count == NULL)
+        return false;
+
+    *events = NULL;
+    *count = 0;
+
+    FILE* const file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to open MIDI file %s for chasing\n", filename);
+        return false;
+    }
+
+    smf_t smf;
+    memset(&smf, 0, sizeof(smf));
+
+    uint8_t* data = NULL;
+    chase_slot_t** sorted = NULL;
+    bool ok = false;
+    long size;
+
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 14 || fseek(file, 0, SEEK_SET) != 0)
+        goto invalid;
+
+    data = (uint8_t*)malloc((size_t)size);
+
+    if (data == NULL || fread(data, 1, (size_t)size, file) != (size_t)size)
+        goto invalid;
+
+    if (memcmp(data, "MThd", 4) != 0 || read_u32_be(data + 4) < 6 || read_u32_be(data + 4) > (size_t)size - 8)
+        goto invalid;
+
+    smf.data = data;
+    smf.size = (size_t)size;
+    smf.header_size = read_u32_be(data + 4);
+    smf.division = read_u16_be(data + 12);
+
+    if (smf.division == 0)
+        goto invalid;
+
+    // first pass for the tempo map, second one for the actual chasing
+    if (! parse_tracks(&smf, 0.0))
+        goto invalid;
+
+    const double seek_tick = seconds_to_ticks(&smf, seconds);
+
+    smf.slots = (chase_slot_t*)calloc(CHASE_SLOTS, sizeof(chase_slot_t));
+    sorted = (chase_slot_t**)malloc(sizeof(chase_slot_t*) * CHASE_SLOTS);
+
+    if (smf.slots == NULL || sorted == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        goto free;
+    }
+
+    if (! parse_tracks(&smf, seek_tick))
+        goto invalid;
+
+    uint32_t used = 0;
+
+    for (uint32_t i = 0; i < CHASE_SLOTS; ++i)
+    {
+        if (smf.slots[i].valid)
+            sorted[used++] = &smf.slots[i];
+    }
+
+    // parameters that never got a value were only selected
+    size_t parameter_count = 0;
+
+    for (size_t i = 0; i < smf.parameter_count; ++i)
+    {
+        if (smf.parameters[i].data_msb >= 0 || smf.parameters[i].data_lsb >= 0)
+            smf.parameters[parameter_count++] = smf.parameters[i];
+    }
+
+    // each parameter needs up to 4 events, plus a null RPN per channel at the end
+    const size_t capacity = used + parameter_count * 4 + 16 * 2;
+
+    if (used != 0 || parameter_count != 0)
+    {
+        if (used != 0)
+            qsort(sorted, used, sizeof(chase_slot_t*), compare_slot);
+        if (parameter_count != 0)
+            qsort(smf.parameters, parameter_count, sizeof(chase_parameter_t), compare_parameter);
+
+        *events = (NativeMidiEvent*)calloc(capacity, sizeof(NativeMidiEvent));
+
+        if (*events == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            goto free;
+        }
+
+        uint32_t written = 0;
+        bool channels_with_parameters[16] = { false };
+
+        for (uint32_t i = 0; i < used; ++i)
+        {
+            NativeMidiEvent* const event = &(*events)[written++];
+            event->size = sorted[i]->size;
+            memcpy(event->data, sorted[i]->data, sorted[i]->size);
+        }
+
+        // data entry only makes sense right after its parameter is selected
+        for (size_t i = 0; i < parameter_count; ++i)
+        {
+            const chase_parameter_t* const parameter = &smf.parameters[i];
+
+            add_controller(*events, &written, parameter->channel, parameter->nrpn ? 99 : 101, parameter->msb);
+            add_controller(*events, &written, parameter->channel, parameter->nrpn ? 98 : 100, parameter->lsb);
+
+            if (parameter->data_msb >= 0)
+                add_controller(*events, &written, parameter->channel, 6, (uint8_t)parameter->data_msb);
+            if (parameter->data_lsb >= 0)
+                add_controller(*events, &written, parameter->channel, 38, (uint8_t)parameter->data_lsb);
+
+            channels_with_parameters[parameter->channel] = true;
+        }
+
+        // deselect, so later data entry in the file does not change a chased parameter by accident
+        for (uint8_t channel = 0; channel < 16; ++channel)
+        {
+            if (! channels_with_parameters[channel])
+                continue;
+
+            add_controller(*events, &written, channel, 101, 127);
+            add_controller(*events, &written, channel, 100, 127);
+        }
+
+        *count = written;
+    }
+
+    ok = true;
+    goto free;
+
+invalid:
+    fprintf(stderr, "Failed to parse MIDI file %s for chasing\n", filename);
+
+free:
+    fclose(file);
+    free(data);
+    free(smf.tempos);
+    free(smf.slots);
+    free(smf.parameters);
+    free(sorted);
+    return ok;
+}
@@ -0,0 +1,26 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#pragma once
+
+#include "CarlaNativePlugin.h"
+
+// read a standard MIDI file and collect the controller, program, channel pressure and pitch-bend state
+// of every channel right before the given time, as a list of events in file order.
+// RPN and NRPN values are chased as complete select and data entry sequences, followed by a null RPN.
+// events must be freed by the caller, count can be 0 if there is nothing to chase.
+bool kuriborosu_midi_chase(const char* filename, double seconds, NativeMidiEvent** events, uint32_t* count);
@@ -0,0 +1,360 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#include "telemetry.h"
+
+#include <math.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+# include <fcntl.h>
+# include <io.h>
+#else
+# include <fcntl.h>
+# include <signal.h>
+# include <unistd.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+#endif
+
+// a single write of up to PIPE_BUF bytes is atomic on pipes, so keep lines under that
+#define TELEMETRY_LINE_SIZE 4096
+
+// minimum time between periodic events
+#define TELEMETRY_INTERVAL 0.5
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+typedef struct _KuriborosuTelemetry {
+    int fd;
+    bool owns_fd;
+    bool socket;
+    double start_time;
+    double last_report;
+    uint64_t dropped;
+    size_t used;
+    // end of the last complete field, used to drop partial fields when the line is too long
+    size_t complete;
+    bool truncated;
+    char line[TELEMETRY_LINE_SIZE];
+} KuriborosuTelemetry;
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifndef _WIN32
+static int connect_unix_socket(const char* const path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+#endif
+
+KuriborosuTelemetry* kuriborosu_telemetry_open(const char* const target)
+{
+    if (target == NULL)
+        return NULL;
+
+    KuriborosuTelemetry* const telemetry = (KuriborosuTelemetry*)calloc(1, sizeof(KuriborosuTelemetry));
+
+    if (telemetry == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    telemetry->fd = -1;
+
+    if (strncmp(target, "fd:", 3) == 0)
+    {
+        char* end;
+        const long fd = strtol(target + 3, &end, 10);
+
+        if (end != target + 3 && *end == '\0' && fd >= 0 && fd <= INT32_MAX)
+            telemetry->fd = (int)fd;
+
+#ifndef _WIN32
+        // inherited sockets can still be written without blocking, through send flags
+        struct stat st;
+        if (telemetry->fd >= 0 && fstat(telemetry->fd, &st) == 0 && S_ISSOCK(st.st_mode))
+            telemetry->socket = true;
+#endif
+    }
+    else if (strncmp(target, "file:", 5) == 0)
+    {
+#ifdef _WIN32
+        telemetry->fd = _open(target + 5, _O_WRONLY|_O_CREAT|_O_APPEND|_O_BINARY, 0644);
+#else
+        telemetry->fd = open(target + 5, O_WRONLY|O_CREAT|O_APPEND, 0644);
+#endif
+        telemetry->owns_fd = true;
+    }
+#ifndef _WIN32
+    else if (strncmp(target, "unix:", 5) == 0)
+    {
+        telemetry->fd = connect_unix_socket(target + 5);
+        telemetry->owns_fd = true;
+        telemetry->socket = true;
+    }
+#endif
+
+    if (telemetry->fd < 0)
+    {
+        fprintf(stderr, "Failed to open telemetry target '%s'\n", target);
+        free(telemetry);
+        return NULL;
+    }
+
+#ifndef _WIN32
+    // never let a slow or dead reader stall or kill the render.
+    // only done for fds opened here, file status flags are shared with every other user of an inherited fd
+    if (telemetry->owns_fd && ! telemetry->socket)
+        fcntl(telemetry->fd, F_SETFL, fcntl(telemetry->fd, F_GETFL) | O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    telemetry->start_time = get_monotonic_time();
+    telemetry->last_report = -TELEMETRY_INTERVAL;
+    return telemetry;
+}
+
+void kuriborosu_telemetry_close(KuriborosuTelemetry* const telemetry)
+{
+    if (telemetry == NULL)
+        return;
+
+    if (telemetry->owns_fd)
+    {
+#ifdef _WIN32
+        _close(telemetry->fd);
+#else
+        close(telemetry->fd);
+#endif
+    }
+
+    free(telemetry);
+}
+
+double kuriborosu_telemetry_get_time(const KuriborosuTelemetry* const telemetry)
+{
+    if (telemetry == NULL)
+        return 0.0;
+
+    return get_monotonic_time() - telemetry->start_time;
+}
+
+bool kuriborosu_telemetry_should_report(KuriborosuTelemetry* const telemetry)
+{
+    if (telemetry == NULL)
+        return false;
+
+    const double now = kuriborosu_telemetry_get_time(telemetry);
+
+    if (now - telemetry->last_report < TELEMETRY_INTERVAL)
+        return false;
+
+    telemetry->last_report = now;
+    return true;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void append(KuriborosuTelemetry* const telemetry, const char* const str, const size_t len)
+{
+    // always leave room for the closing "}\n"
+    if (telemetry->truncated || telemetry->used + len > TELEMETRY_LINE_SIZE - 2)
+    {
+        telemetry->truncated = true;
+        return;
+    }
+
+    memcpy(telemetry->line + telemetry->used, str, len);
+    telemetry->used += len;
+}
+
+static void append_string(KuriborosuTelemetry* const telemetry, const char* str)
+{
+    append(telemetry, "\"", 1);
+
+    for (; *str != '\0'; ++str)
+    {
+        const unsigned char c = (unsigned char)*str;
+
+        if (c == '"' || c == '\\')
+        {
+            const char escaped[2] = { '\\', (char)c };
+            append(telemetry, escaped, 2);
+        }
+        else if (c < 0x20)
+        {
+            char escaped[8];
+            append(telemetry, escaped, (size_t)snprintf(escaped, sizeof(escaped), "\\u%04x", c));
+        }
+        else
+        {
+            append(telemetry, str, 1);
+        }
+    }
+
+    append(telemetry, "\"", 1);
+}
+
+static void field_done(KuriborosuTelemetry* const telemetry)
+{
+    if (! telemetry->truncated)
+        telemetry->complete = telemetry->used;
+}
+
+static void append_key(KuriborosuTelemetry* const telemetry, const char* const key)
+{
+    append(telemetry, ",", 1);
+    append_string(telemetry, key);
+    append(telemetry, ":", 1);
+}
+
+void kuriborosu_telemetry_begin(KuriborosuTelemetry* const telemetry, const char* const event)
+{
+    if (telemetry == NULL)
+        return;
+
+    telemetry->used = 0;
+    telemetry->truncated = false;
+
+    append(telemetry, "{\"event\":", 9);
+    append_string(telemetry, event);
+    field_done(telemetry);
+    kuriborosu_telemetry_add_double(telemetry, "time", kuriborosu_telemetry_get_time(telemetry));
+
+    if (telemetry->dropped != 0)
+        kuriborosu_telemetry_add_uint(telemetry, "dropped", telemetry->dropped);
+}
+
+void kuriborosu_telemetry_add_string(KuriborosuTelemetry* const telemetry, const char* const key, const char* const value)
+{
+    if (telemetry == NULL)
+        return;
+
+    append_key(telemetry, key);
+
+    if (value != NULL)
+        append_string(telemetry, value);
+    else
+        append(telemetry, "null", 4);
+
+    field_done(telemetry);
+}
+
+void kuriborosu_telemetry_add_uint(KuriborosuTelemetry* const telemetry, const char* const key, const uint64_t value)
+{
+    if (telemetry == NULL)
+        return;
+
+    char str[24];
+    append_key(telemetry, key);
+    append(telemetry, str, (size_t)snprintf(str, sizeof(str), "%llu", (unsigned long long)value));
+    field_done(telemetry);
+}
+
+void kuriborosu_telemetry_add_double(KuriborosuTelemetry* const telemetry, const char* const key, const double value)
+{
+    if (telemetry == NULL)
+        return;
+
+    append_key(telemetry, key);
+
+    // JSON has no representation for inf and nan
+    if (isfinite(value))
+    {
+        char str[32];
+        append(telemetry, str, (size_t)snprintf(str, sizeof(str), "%.6g", value));
+    }
+    else
+    {
+        append(telemetry, "null", 4);
+    }
+
+    field_done(telemetry);
+}
+
+void kuriborosu_telemetry_add_bool(KuriborosuTelemetry* const telemetry, const char* const key, const bool value)
+{
+    if (telemetry == NULL)
+        return;
+
+    append_key(telemetry, key);
+    append(telemetry, value ? "true" : "false", value ? 4 : 5);
+    field_done(telemetry);
+}
+
+void kuriborosu_telemetry_end(KuriborosuTelemetry* const telemetry)
+{
+    if (telemetry == NULL)
+        return;
+
+    if (telemetry->truncated)
+        telemetry->used = telemetry->complete;
+
+    // room for this was reserved in append
+    telemetry->line[telemetry->used++] = '}';
+    telemetry->line[telemetry->used++] = '\n';
+
+#ifdef _WIN32
+    const int written = _write(telemetry->fd, telemetry->line, (unsigned int)telemetry->used);
+#else
+    const ssize_t written = telemetry->socket
+                          ? send(telemetry->fd, telemetry->line, telemetry->used, MSG_DONTWAIT|MSG_NOSIGNAL)
+                          : write(telemetry->fd, telemetry->line, telemetry->used);
+#endif
+
+    // partial lines cannot be recovered without blocking, count them as dropped too
+    if (written != (ssize_t)telemetry->used)
+        ++telemetry->dropped;
+}
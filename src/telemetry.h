@@ -0,0 +1,44 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _KuriborosuTelemetry KuriborosuTelemetry;
+
+// JSON-lines event stream, target is one of "fd:NUMBER", "file:PATH" or "unix:PATH" (socket)
+// writes never block, lines are dropped (and counted) if the reader cannot keep up.
+// flags of "fd:" targets are left untouched, unless they are sockets they only avoid blocking if already non-blocking
+// all functions are no-ops when called with a NULL telemetry
+KuriborosuTelemetry* kuriborosu_telemetry_open(const char* target);
+void kuriborosu_telemetry_close(KuriborosuTelemetry* telemetry);
+
+// seconds since the telemetry was opened, monotonic
+double kuriborosu_telemetry_get_time(const KuriborosuTelemetry* telemetry);
+
+// rate limit for periodic events, returns true at most once per interval
+bool kuriborosu_telemetry_should_report(KuriborosuTelemetry* telemetry);
+
+// build and send a single line, begin adds the "event" and "time" fields
+void kuriborosu_telemetry_begin(KuriborosuTelemetry* telemetry, const char* event);
+void kuriborosu_telemetry_add_string(KuriborosuTelemetry* telemetry, const char* key, const char* value);
+void kuriborosu_telemetry_add_uint(KuriborosuTelemetry* telemetry, const char* key, uint64_t value);
+void kuriborosu_telemetry_add_double(KuriborosuTelemetry* telemetry, const char* key, double value);
+void kuriborosu_telemetry_add_bool(KuriborosuTelemetry* telemetry, const char* key, bool value);
+void kuriborosu_telemetry_end(KuriborosuTelemetry* telemetry);
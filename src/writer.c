@@ -0,0 +1,641 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include "writer.h"
+#include "loudness.h"
+
+#include <errno.h>
+#include <math.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sndfile.h>
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+// size of a canonical 16-bit PCM WAV header, same as libsndfile writes
+#define WAV_HEADER_SIZE 44
+
+// O_DIRECT needs offsets, sizes and memory aligned to the logical block size, 4096 is safe everywhere
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_BLOCK_SIZE (256 * DIRECT_ALIGNMENT)
+
+typedef struct _KuriborosuWriter {
+    writer_mode_t mode;
+    uint32_t channels;
+    uint32_t sample_rate;
+    uint64_t max_frames;
+    uint64_t frames_written;
+    SNDFILE* sndfile;
+    // normalize mode
+    FILE* spill;
+    KuriborosuLoudnessMeter* meter;
+    float normalize_lufs;
+    float normalize_true_peak;
+    // gain taken from another output instead of measured, used for taps
+    bool normalize_gain_set;
+    float normalize_gain;
+#ifndef _WIN32
+    int fd;
+    // writer_mode_mmap
+    uint8_t* map;
+    size_t map_size;
+    // writer_mode_direct
+    uint8_t* block;
+    size_t block_used;
+    off_t block_offset;
+#endif
+} KuriborosuWriter;
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// matches libsndfile float to 16-bit WAV conversion with clipping and normalization turned on,
+// which scales to 32-bit, rounds and then keeps the upper 16 bits
+static inline int16_t float_to_pcm16(const float value)
+{
+    const float scaled = value * (1.0f * 0x80000000);
+
+    if (scaled >= (1.0f * 0x7FFFFFFF))
+        return 32767;
+    if (scaled <= (-8.0f * 0x10000000))
+        return -32768;
+
+    return (int16_t)(lrintf(scaled) >> 16);
+}
+
+static void write_u16_le(uint8_t* const dst, const uint16_t value)
+{
+    dst[0] = value & 0xff;
+    dst[1] = (value >> 8) & 0xff;
+}
+
+static void write_u32_le(uint8_t* const dst, const uint32_t value)
+{
+    dst[0] = value & 0xff;
+    dst[1] = (value >> 8) & 0xff;
+    dst[2] = (value >> 16) & 0xff;
+    dst[3] = (value >> 24) & 0xff;
+}
+
+static void convert_to_pcm16_le(uint8_t* dst, const float* const src, const size_t samples)
+{
+    for (size_t i = 0; i < samples; ++i, dst += 2)
+        write_u16_le(dst, (uint16_t)float_to_pcm16(src[i]));
+}
+
+static void write_wav_header(uint8_t* const dst, const KuriborosuWriter* const writer)
+{
+    const uint32_t block_align = writer->channels * 2;
+    const uint32_t data_size = (uint32_t)(writer->frames_written * block_align);
+
+    memcpy(dst, "RIFF", 4);
+    write_u32_le(dst + 4, 36 + data_size);
+    memcpy(dst + 8, "WAVE", 4);
+    memcpy(dst + 12, "fmt ", 4);
+    write_u32_le(dst + 16, 16);
+    write_u16_le(dst + 20, 1); // WAVE_FORMAT_PCM
+    write_u16_le(dst + 22, (uint16_t)writer->channels);
+    write_u32_le(dst + 24, writer->sample_rate);
+    write_u32_le(dst + 28, writer->sample_rate * block_align);
+    write_u16_le(dst + 32, (uint16_t)block_align);
+    write_u16_le(dst + 34, 16);
+    memcpy(dst + 36, "data", 4);
+    write_u32_le(dst + 40, data_size);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static bool sndfile_open(KuriborosuWriter* const writer, const char* const filename)
+{
+    SF_INFO sf_fmt = {
+        .frames = 0,
+        .samplerate = writer->sample_rate,
+        .channels = writer->channels,
+        .format = SF_FORMAT_WAV|SF_FORMAT_PCM_16,
+        .sections = 0,
+        .seekable = 0,
+    };
+    writer->sndfile = sf_open(filename, SFM_WRITE, &sf_fmt);
+
+    if (writer->sndfile == NULL)
+    {
+        fprintf(stderr, "Failed to open output file %s, error was: %s\n", filename, sf_strerror(NULL));
+        return false;
+    }
+
+    // Turn on clipping and normalization of floats (-1.0 - 1.0)
+    sf_command(writer->sndfile, SFC_SET_CLIPPING, NULL, SF_TRUE);
+    sf_command(writer->sndfile, SFC_SET_NORM_FLOAT, NULL, SF_TRUE);
+    return true;
+}
+
+#ifndef _WIN32
+// reserve real blocks for the whole file, so writing through a mapping can never hit a hole on a full disk or quota.
+// a sparse file is enough when not required, as regular writes report their own errors
+static bool preallocate(const int fd, const off_t size, const bool required)
+{
+#ifdef __linux__
+    if (fallocate(fd, 0, 0, size) == 0)
+        return true;
+
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+        return false;
+#endif
+
+    if (required)
+    {
+#if defined(__APPLE__)
+        fstore_t store = {
+            .fst_flags = F_ALLOCATEALL,
+            .fst_posmode = F_PEOFPOSMODE,
+            .fst_offset = 0,
+            .fst_length = size,
+        };
+
+        if (fcntl(fd, F_PREALLOCATE, &store) != 0)
+            return false;
+#else
+        // filesystem without fallocate support, glibc emulates this by writing every block
+        const int err = posix_fallocate(fd, 0, size);
+
+        if (err != 0)
+        {
+            errno = err;
+            return false;
+        }
+#endif
+    }
+
+    return ftruncate(fd, size) == 0;
+}
+
+static bool mmap_open(KuriborosuWriter* const writer)
+{
+    writer->map_size = WAV_HEADER_SIZE + writer->max_frames * writer->channels * 2;
+
+    if (! preallocate(writer->fd, (off_t)writer->map_size, true))
+        return false;
+
+    void* const map = mmap(NULL, writer->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, writer->fd, 0);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    writer->map = (uint8_t*)map;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, writer->map_size, MADV_SEQUENTIAL);
+#endif
+    return true;
+}
+
+static bool direct_open(KuriborosuWriter* const writer)
+{
+#ifdef __linux__
+    // not all filesystems support O_DIRECT (e.g. tmpfs), fallback to regular aligned writes in that case
+    if (fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) | O_DIRECT) != 0)
+        fprintf(stderr, "O_DIRECT not supported by output filesystem, using regular aligned writes\n");
+#elif defined(F_NOCACHE)
+    fcntl(writer->fd, F_NOCACHE, 1);
+#endif
+
+    const off_t size = WAV_HEADER_SIZE + writer->max_frames * writer->channels * 2;
+
+    if (! preallocate(writer->fd, size, false))
+        return false;
+
+    void* block;
+    if (posix_memalign(&block, DIRECT_ALIGNMENT, DIRECT_BLOCK_SIZE) != 0)
+        return false;
+
+    writer->block = (uint8_t*)block;
+
+    // header placeholder, written properly on close
+    memset(writer->block, 0, WAV_HEADER_SIZE);
+    writer->block_used = WAV_HEADER_SIZE;
+    return true;
+}
+
+static bool direct_flush(KuriborosuWriter* const writer)
+{
+    // pad to alignment, the extra bytes are removed by the final truncate
+    const size_t size = (writer->block_used + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+    memset(writer->block + writer->block_used, 0, size - writer->block_used);
+
+    if (pwrite(writer->fd, writer->block, size, writer->block_offset) != (ssize_t)size)
+        return false;
+
+    writer->block_offset += (off_t)size;
+    writer->block_used = 0;
+    return true;
+}
+#endif
+
+// --------------------------------------------------------------------------------------------------------------------
+
+KuriborosuWriter* kuriborosu_writer_open(const char* const filename, writer_mode_t mode,
+                                         const uint32_t channels, const uint32_t sample_rate, const uint64_t max_frames)
+{
+    if (filename == NULL || channels == 0 || sample_rate == 0)
+        return NULL;
+
+    KuriborosuWriter* const writer = (KuriborosuWriter*)malloc(sizeof(KuriborosuWriter));
+
+    if (writer == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    memset(writer, 0, sizeof(KuriborosuWriter));
+    writer->channels = channels;
+    writer->sample_rate = sample_rate;
+    writer->max_frames = max_frames;
+
+#ifdef _WIN32
+    if (mode != writer_mode_sndfile)
+    {
+        fprintf(stderr, "Preallocated writers are not supported on this system, using libsndfile\n");
+        mode = writer_mode_sndfile;
+    }
+#endif
+
+    // WAV sizes are 32-bit
+    if (mode != writer_mode_sndfile && WAV_HEADER_SIZE + max_frames * channels * 2 > UINT32_MAX)
+    {
+        fprintf(stderr, "Output file too big for preallocation, using libsndfile\n");
+        mode = writer_mode_sndfile;
+    }
+
+    writer->mode = mode;
+
+    if (mode == writer_mode_sndfile)
+    {
+        if (sndfile_open(writer, filename))
+            return writer;
+
+        free(writer);
+        return NULL;
+    }
+
+#ifndef _WIN32
+    writer->fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+
+    if (writer->fd < 0)
+    {
+        fprintf(stderr, "Failed to open output file %s, error was: %s\n", filename, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+
+    const bool ok = mode == writer_mode_mmap ? mmap_open(writer) : direct_open(writer);
+
+    if (ok)
+        return writer;
+
+    fprintf(stderr, "Failed to preallocate output file %s, error was: %s\n", filename, strerror(errno));
+    free(writer->block);
+    close(writer->fd);
+    unlink(filename);
+#endif
+
+    free(writer);
+    return NULL;
+}
+
+static bool backend_write(KuriborosuWriter* const writer, const float* const interleaved, const uint32_t frames)
+{
+    switch (writer->mode)
+    {
+    case writer_mode_sndfile:
+        if (sf_writef_float(writer->sndfile, interleaved, frames) != frames)
+            return false;
+        writer->frames_written += frames;
+        return true;
+
+#ifndef _WIN32
+    case writer_mode_mmap:
+        if (writer->frames_written + frames > writer->max_frames)
+        {
+            fprintf(stderr, "Render exceeded preallocated output size\n");
+            return false;
+        }
+
+        convert_to_pcm16_le(writer->map + WAV_HEADER_SIZE + writer->frames_written * writer->channels * 2,
+                            interleaved, (size_t)frames * writer->channels);
+        writer->frames_written += frames;
+        return true;
+
+    case writer_mode_direct:
+    {
+        const float* src = interleaved;
+        size_t samples = (size_t)frames * writer->channels;
+
+        while (samples != 0)
+        {
+            // header size and block size are both even, so samples never straddle 2 blocks
+            size_t todo = (DIRECT_BLOCK_SIZE - writer->block_used) / 2;
+            if (todo > samples)
+                todo = samples;
+
+            convert_to_pcm16_le(writer->block + writer->block_used, src, todo);
+            writer->block_used += todo * 2;
+            src += todo;
+            samples -= todo;
+
+            if (writer->block_used == DIRECT_BLOCK_SIZE && ! direct_flush(writer))
+            {
+                fprintf(stderr, "Failed to write output file, error was: %s\n", strerror(errno));
+                return false;
+            }
+        }
+
+        writer->frames_written += frames;
+        return true;
+    }
+#endif
+
+    default:
+        return false;
+    }
+}
+
+bool kuriborosu_writer_write(KuriborosuWriter* const writer, const float* const interleaved, const uint32_t frames)
+{
+    if (writer == NULL || interleaved == NULL)
+        return false;
+
+    if (writer->spill == NULL)
+        return backend_write(writer, interleaved, frames);
+
+    if (! kuriborosu_loudness_meter_process(writer->meter, interleaved, frames))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    if (fwrite(interleaved, sizeof(float) * writer->channels, frames, writer->spill) != frames)
+    {
+        fprintf(stderr, "Failed to write spill file, error was: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// second pass of normalize mode, spill file to gain and limiter to the actual output
+static bool normalize_finish(KuriborosuWriter* const writer)
+{
+    const double loudness = kuriborosu_loudness_meter_get_integrated(writer->meter);
+    const double true_peak = kuriborosu_loudness_meter_get_true_peak(writer->meter);
+    const float ceiling = powf(10.0f, writer->normalize_true_peak / 20.0f);
+    const float gain = writer->normalize_gain_set ? writer->normalize_gain
+                                                  : kuriborosu_writer_get_normalize_gain(writer);
+
+    if (! writer->normalize_gain_set && ! isfinite(loudness))
+        fprintf(stderr, "Output is silent, skipping loudness normalization\n");
+
+    printf("measured %.2f LUFS, %.2f dBTP, applying %.2f dB of gain\n",
+           loudness, 20.0 * log10(true_peak), 20.0 * log10(gain));
+
+    if (fflush(writer->spill) != 0 || fseek(writer->spill, 0, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "Failed to read back spill file, error was: %s\n", strerror(errno));
+        return false;
+    }
+
+    enum { chunk_frames = 4096 };
+    const uint32_t channels = writer->channels;
+    float* const in = (float*)malloc(sizeof(float) * channels * chunk_frames);
+    float* out = NULL;
+    KuriborosuLimiter* limiter = NULL;
+    bool ok = in != NULL;
+
+    // limiter is only needed if the gain pushes the true peak over the ceiling
+    if (ok && true_peak * gain > ceiling)
+    {
+        limiter = kuriborosu_limiter_create(channels, writer->sample_rate, gain, ceiling);
+        ok = limiter != NULL;
+
+        if (ok)
+        {
+            const uint32_t latency = kuriborosu_limiter_get_latency(limiter);
+            out = (float*)malloc(sizeof(float) * channels * (latency > chunk_frames ? latency : chunk_frames));
+            ok = out != NULL;
+        }
+    }
+
+    if (! ok)
+    {
+        fprintf(stderr, "Out of memory\n");
+        goto free;
+    }
+
+    for (size_t frames; ok && (frames = fread(in, sizeof(float) * channels, chunk_frames, writer->spill)) != 0;)
+    {
+        if (limiter != NULL)
+        {
+            ok = backend_write(writer, out, kuriborosu_limiter_process(limiter, in, out, (uint32_t)frames));
+        }
+        else
+        {
+            for (size_t i = 0; i < frames * channels; ++i)
+                in[i] *= gain;
+
+            ok = backend_write(writer, in, (uint32_t)frames);
+        }
+    }
+
+    if (ferror(writer->spill))
+    {
+        fprintf(stderr, "Failed to read back spill file, error was: %s\n", strerror(errno));
+        ok = false;
+    }
+
+    if (ok && limiter != NULL)
+        ok = backend_write(writer, out, kuriborosu_limiter_flush(limiter, out));
+
+free:
+    kuriborosu_limiter_destroy(limiter);
+    free(in);
+    free(out);
+    return ok;
+}
+
+bool kuriborosu_writer_close(KuriborosuWriter* const writer)
+{
+    if (writer == NULL)
+        return false;
+
+    bool ok = true;
+
+    if (writer->spill != NULL)
+    {
+        ok = normalize_finish(writer);
+        fclose(writer->spill);
+        kuriborosu_loudness_meter_destroy(writer->meter);
+    }
+
+    switch (writer->mode)
+    {
+    case writer_mode_sndfile:
+        ok = sf_close(writer->sndfile) == 0 && ok;
+        break;
+
+#ifndef _WIN32
+    case writer_mode_mmap:
+    {
+        const off_t size = WAV_HEADER_SIZE + writer->frames_written * writer->channels * 2;
+
+        // writeback errors are only reported here, not by the stores into the mapping
+        write_wav_header(writer->map, writer);
+        ok = msync(writer->map, writer->map_size, MS_SYNC) == 0 && ok;
+        ok = munmap(writer->map, writer->map_size) == 0 && ok;
+        ok = ftruncate(writer->fd, size) == 0 && ok;
+        ok = close(writer->fd) == 0 && ok;
+        break;
+    }
+
+    case writer_mode_direct:
+    {
+        const off_t size = WAV_HEADER_SIZE + writer->frames_written * writer->channels * 2;
+
+        if (writer->block_used != 0)
+            ok = direct_flush(writer) && ok;
+
+        // header is not aligned, so it needs to go through the page cache
+       #ifdef __linux__
+        fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+       #endif
+        uint8_t header[WAV_HEADER_SIZE];
+        write_wav_header(header, writer);
+
+        ok = pwrite(writer->fd, header, WAV_HEADER_SIZE, 0) == WAV_HEADER_SIZE && ok;
+        ok = ftruncate(writer->fd, size) == 0 && ok;
+        ok = fsync(writer->fd) == 0 && ok;
+        ok = close(writer->fd) == 0 && ok;
+        free(writer->block);
+        break;
+    }
+#endif
+
+    default:
+        break;
+    }
+
+    if (! ok)
+        fprintf(stderr, "Failed to finalize output file\n");
+
+    free(writer);
+    return ok;
+}
+
+uint64_t kuriborosu_writer_get_pending_frames(const KuriborosuWriter* const writer)
+{
+    if (writer == NULL)
+        return 0;
+
+    if (writer->spill != NULL)
+        return (uint64_t)ftell(writer->spill) / (sizeof(float) * writer->channels);
+
+#ifndef _WIN32
+    if (writer->mode == writer_mode_direct)
+    {
+        const size_t header_size = writer->block_offset == 0 ? WAV_HEADER_SIZE : 0;
+        return (writer->block_used - header_size) / (writer->channels * 2);
+    }
+#endif
+
+    return 0;
+}
+
+bool kuriborosu_writer_mode_from_string(const char* const name, writer_mode_t* const mode)
+{
+    if (strcmp(name, "sndfile") == 0)
+        *mode = writer_mode_sndfile;
+    else if (strcmp(name, "mmap") == 0)
+        *mode = writer_mode_mmap;
+    else if (strcmp(name, "direct") == 0)
+        *mode = writer_mode_direct;
+    else
+        return false;
+
+    return true;
+}
+
+bool kuriborosu_writer_enable_normalize(KuriborosuWriter* const writer, const float target_lufs, const float true_peak_dbtp)
+{
+    if (writer == NULL || writer->spill != NULL || writer->frames_written != 0)
+        return false;
+
+    writer->meter = kuriborosu_loudness_meter_create(writer->channels, writer->sample_rate);
+
+    if (writer->meter == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    // removed automatically when closed
+    writer->spill = tmpfile();
+
+    if (writer->spill == NULL)
+    {
+        fprintf(stderr, "Failed to create spill file, error was: %s\n", strerror(errno));
+        kuriborosu_loudness_meter_destroy(writer->meter);
+        writer->meter = NULL;
+        return false;
+    }
+
+    writer->normalize_lufs = target_lufs;
+    writer->normalize_true_peak = true_peak_dbtp;
+    return true;
+}
+
+float kuriborosu_writer_get_normalize_gain(const KuriborosuWriter* const writer)
+{
+    if (writer == NULL || writer->meter == NULL)
+        return 1.0f;
+
+    const double loudness = kuriborosu_loudness_meter_get_integrated(writer->meter);
+
+    if (! isfinite(loudness))
+        return 1.0f;
+
+    return powf(10.0f, (float)(writer->normalize_lufs - loudness) / 20.0f);
+}
+
+bool kuriborosu_writer_set_normalize_gain(KuriborosuWriter* const writer, const float gain)
+{
+    if (writer == NULL || writer->spill == NULL || ! (gain > 0.0f))
+        return false;
+
+    writer->normalize_gain_set = true;
+    writer->normalize_gain = gain;
+    return true;
+}
@@ -0,0 +1,53 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _KuriborosuWriter KuriborosuWriter;
+
+typedef enum writer_mode_t {
+    // regular libsndfile appends
+    writer_mode_sndfile,
+    // preallocate the full file size and write PCM through a memory mapping
+    writer_mode_mmap,
+    // preallocate the full file size and write aligned blocks with O_DIRECT
+    writer_mode_direct
+} writer_mode_t;
+
+// all writers produce 16-bit PCM WAV files, max_frames is only used for preallocation
+KuriborosuWriter* kuriborosu_writer_open(const char* filename, writer_mode_t mode,
+                                         uint32_t channels, uint32_t sample_rate, uint64_t max_frames);
+bool kuriborosu_writer_write(KuriborosuWriter* writer, const float* interleaved, uint32_t frames);
+bool kuriborosu_writer_close(KuriborosuWriter* writer);
+
+// frames written but not yet in the output file (staged for direct writes, or spilled for normalization)
+uint64_t kuriborosu_writer_get_pending_frames(const KuriborosuWriter* writer);
+
+// spool everything written into a float spill file while measuring loudness,
+// then on close apply gain to reach target_lufs plus a true-peak limiter before the actual output is written
+// must be called before the first write
+bool kuriborosu_writer_enable_normalize(KuriborosuWriter* writer, float target_lufs, float true_peak_dbtp);
+
+// gain needed to reach target_lufs from what was written so far, 1.0 if not normalizing or silent
+float kuriborosu_writer_get_normalize_gain(const KuriborosuWriter* writer);
+// apply this gain on close instead of the measured one, the true-peak limiter still uses this writer's own peaks
+bool kuriborosu_writer_set_normalize_gain(KuriborosuWriter* writer, float gain);
+
+bool kuriborosu_writer_mode_from_string(const char* name, writer_mode_t* mode);
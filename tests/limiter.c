@@ -0,0 +1,91 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#include "src/loudness.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SAMPLE_RATE 48000
+#define CHANNELS 2
+#define SECONDS 2
+
+// high gain sines, low frequencies keep the required gain falling for longer than the lookahead window
+static bool check_sine(const float frequency, const float amplitude, const float gain, const float ceiling_db)
+{
+    const uint32_t frames = SAMPLE_RATE * SECONDS;
+    const float ceiling = powf(10.0f, ceiling_db / 20.0f);
+
+    KuriborosuLimiter* const limiter = kuriborosu_limiter_create(CHANNELS, SAMPLE_RATE, gain, ceiling);
+    KuriborosuLoudnessMeter* const meter = kuriborosu_loudness_meter_create(CHANNELS, SAMPLE_RATE);
+    float* const in = (float*)malloc(sizeof(float) * frames * CHANNELS);
+    float* const out = (float*)malloc(sizeof(float) * (frames + kuriborosu_limiter_get_latency(limiter)) * CHANNELS);
+
+    if (limiter == NULL || meter == NULL || in == NULL || out == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < frames; ++i)
+    {
+        const float value = amplitude * sinf(2.0f * (float)M_PI * frequency * i / SAMPLE_RATE);
+
+        for (uint32_t c = 0; c < CHANNELS; ++c)
+            in[i * CHANNELS + c] = value;
+    }
+
+    uint32_t written = kuriborosu_limiter_process(limiter, in, out, frames);
+    written += kuriborosu_limiter_flush(limiter, out + written * CHANNELS);
+
+    float sample_peak = 0.0f;
+
+    for (uint32_t i = 0; i < written * CHANNELS; ++i)
+    {
+        if (fabsf(out[i]) > sample_peak)
+            sample_peak = fabsf(out[i]);
+    }
+
+    kuriborosu_loudness_meter_process(meter, out, written);
+
+    const double sample_peak_db = 20.0 * log10(sample_peak);
+    const double true_peak_db = 20.0 * log10(kuriborosu_loudness_meter_get_true_peak(meter));
+    const bool ok = written == frames && true_peak_db <= ceiling_db + 0.05;
+
+    printf("%s: %g Hz sine at %g with gain %g, %u/%u frames, %.2f dBFS sample peak, %.2f dBTP true peak\n",
+           ok ? "ok" : "FAIL", frequency, amplitude, gain, written, frames, sample_peak_db, true_peak_db);
+
+    free(in);
+    free(out);
+    kuriborosu_loudness_meter_destroy(meter);
+    kuriborosu_limiter_destroy(limiter);
+    return ok;
+}
+
+int main(void)
+{
+    bool ok = true;
+
+    ok &= check_sine(20.0f, 0.9f, 4.0f, -1.0f);
+    ok &= check_sine(40.0f, 0.9f, 4.0f, -1.0f);
+    ok &= check_sine(60.0f, 0.9f, 8.0f, -1.0f);
+    ok &= check_sine(997.0f, 0.9f, 4.0f, -1.0f);
+    ok &= check_sine(12000.0f, 0.5f, 4.0f, -1.0f);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
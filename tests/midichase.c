@@ -0,0 +1,129 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#include "src/midichase.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILENAME "midichase-test.mid"
+
+// single track, 480 ticks per beat, default tempo of 120 BPM so 960 ticks per second
+static bool write_smf(const uint8_t* const track, const uint32_t size)
+{
+    const uint8_t header[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x01, 0xe0,
+        'M', 'T', 'r', 'k', (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size,
+    };
+
+    FILE* const file = fopen(FILENAME, "wb");
+
+    if (file == NULL)
+        return false;
+
+    const bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header)
+                 && fwrite(track, 1, size, file) == size;
+
+    return fclose(file) == 0 && ok;
+}
+
+// events are given as 3 byte triplets
+static bool check(const char* const name, const uint8_t* const track, const uint32_t size, const double seconds,
+                  const uint8_t* const expected, const uint32_t expected_count)
+{
+    NativeMidiEvent* events = NULL;
+    uint32_t count = 0;
+    bool ok = write_smf(track, size) && kuriborosu_midi_chase(FILENAME, seconds, &events, &count);
+
+    ok = ok && count == expected_count;
+
+    for (uint32_t i = 0; ok && i < count; ++i)
+        ok = events[i].size == 3 && memcmp(events[i].data, expected + i * 3, 3) == 0;
+
+    printf("%s: %s, %u events\n", ok ? "ok" : "FAIL", name, count);
+
+    for (uint32_t i = 0; ! ok && i < count; ++i)
+        printf("  %02X %02X %02X\n", events[i].data[0], events[i].data[1], events[i].data[2]);
+
+    free(events);
+    remove(FILENAME);
+    return ok;
+}
+
+int main(void)
+{
+    bool ok = true;
+
+    // GM pitch-bend range, closed with a null RPN, and a volume change after the seek position
+    {
+        const uint8_t track[] = {
+            0x00, 0xb0, 101, 0, 0x00, 100, 0, 0x00, 6, 12, 0x00, 101, 127, 0x00, 100, 127,
+            0x00, 7, 100,
+            0x87, 0x68, 7, 50,
+            0x00, 0xff, 0x2f, 0x00,
+        };
+        const uint8_t expected[] = {
+            0xb0, 7, 100,
+            0xb0, 101, 0, 0xb0, 100, 0, 0xb0, 6, 12,
+            0xb0, 101, 127, 0xb0, 100, 127,
+        };
+        ok &= check("pitch-bend range", track, sizeof(track), 1.0, expected, sizeof(expected) / 3);
+    }
+
+    // two RPNs and a NRPN on different channels, data entry LSB and increment
+    {
+        const uint8_t track[] = {
+            0x00, 0xb0, 101, 0, 0x00, 100, 0, 0x00, 6, 2, 0x00, 96, 0,
+            0x00, 100, 1, 0x00, 6, 64, 0x00, 38, 0,
+            0x00, 0xb1, 99, 1, 0x00, 98, 8, 0x00, 6, 50,
+            0x00, 0xff, 0x2f, 0x00,
+        };
+        const uint8_t expected[] = {
+            0xb0, 101, 0, 0xb0, 100, 0, 0xb0, 6, 3,
+            0xb0, 101, 0, 0xb0, 100, 1, 0xb0, 6, 64, 0xb0, 38, 0,
+            0xb1, 99, 1, 0xb1, 98, 8, 0xb1, 6, 50,
+            0xb0, 101, 127, 0xb0, 100, 127,
+            0xb1, 101, 127, 0xb1, 100, 127,
+        };
+        ok &= check("multiple parameters", track, sizeof(track), 1.0, expected, sizeof(expected) / 3);
+    }
+
+    // data entry without a selected parameter, program and pitch-bend, and no tempo events
+    {
+        const uint8_t track[] = {
+            0x00, 0xb2, 6, 10,
+            0x00, 0xc2, 5,
+            0x00, 0xe2, 0x00, 0x50,
+            0x00, 0xff, 0x2f, 0x00,
+        };
+        const uint8_t expected[] = {
+            0xc2, 5, 0, 0xe2, 0x00, 0x50,
+        };
+        NativeMidiEvent* events = NULL;
+        uint32_t count = 0;
+        bool program_ok = write_smf(track, sizeof(track)) && kuriborosu_midi_chase(FILENAME, 1.0, &events, &count)
+                        && count == 2 && events[0].size == 2 && memcmp(events[0].data, expected, 2) == 0
+                        && events[1].size == 3 && memcmp(events[1].data, expected + 3, 3) == 0;
+        printf("%s: unselected data entry, %u events\n", program_ok ? "ok" : "FAIL", count);
+        free(events);
+        remove(FILENAME);
+        ok &= program_ok;
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,127 @@
+/*
+ * kuriborosu
+ * Copyright (C) 2021-2023 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * For a full copy of the GNU Affero General Public License see LICENSE file.
+ */
+
+#include "src/writer.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SAMPLE_RATE 48000
+#define CHANNELS 2
+#define BUFFER_SIZE 256
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// writes the same amount of audio through a writer mode, in render-sized blocks
+static bool bench(const char* const dir, const char* const mode_name, const uint32_t seconds, const uint32_t runs)
+{
+    writer_mode_t mode;
+    if (! kuriborosu_writer_mode_from_string(mode_name, &mode))
+    {
+        fprintf(stderr, "Invalid writer mode '%s'\n", mode_name);
+        return false;
+    }
+
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s/kuriborosu-bench-%s.wav", dir, mode_name);
+
+    const uint64_t frames = (uint64_t)seconds * SAMPLE_RATE;
+    float buffer[BUFFER_SIZE * CHANNELS];
+
+    double best_write = HUGE_VAL;
+    double best_sync = HUGE_VAL;
+
+    for (uint32_t run = 0; run < runs; ++run)
+    {
+        const double start = get_time();
+        KuriborosuWriter* const writer = kuriborosu_writer_open(filename, mode, CHANNELS, SAMPLE_RATE, frames);
+
+        if (writer == NULL)
+            return false;
+
+        for (uint64_t pos = 0; pos < frames; pos += BUFFER_SIZE)
+        {
+            for (uint32_t i = 0; i < BUFFER_SIZE; ++i)
+                buffer[i * CHANNELS] = buffer[i * CHANNELS + 1] = 0.5f * sinf((float)((pos + i) % SAMPLE_RATE) * 0.0575f);
+
+            if (! kuriborosu_writer_write(writer, buffer, BUFFER_SIZE))
+            {
+                kuriborosu_writer_close(writer);
+                return false;
+            }
+        }
+
+        if (! kuriborosu_writer_close(writer))
+            return false;
+
+        const double written = get_time();
+
+        // not every writer syncs on close, make the comparison fair
+        const int fd = open(filename, O_RDONLY);
+        if (fd < 0 || fsync(fd) != 0)
+            return false;
+        close(fd);
+
+        const double synced = get_time();
+
+        if (written - start < best_write)
+            best_write = written - start;
+        if (synced - start < best_sync)
+            best_sync = synced - start;
+
+        unlink(filename);
+    }
+
+    printf("%-8s %u s of audio: %.3f s until closed, %.3f s until synced (%.0fx realtime)\n",
+           mode_name, seconds, best_write, best_sync, seconds / best_sync);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s DIRECTORY [SECONDS] [RUNS]\n"
+               "Compare output writer modes by writing SECONDS of 48kHz stereo audio into DIRECTORY, best of RUNS.\n",
+               argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const uint32_t seconds = argc > 2 ? (uint32_t)atoi(argv[2]) : 600;
+    const uint32_t runs = argc > 3 ? (uint32_t)atoi(argv[3]) : 3;
+
+    if (seconds == 0 || runs == 0)
+        return EXIT_FAILURE;
+
+    bool ok = true;
+
+    ok = bench(argv[1], "sndfile", seconds, runs) && ok;
+    ok = bench(argv[1], "mmap", seconds, runs) && ok;
+    ok = bench(argv[1], "direct", seconds, runs) && ok;
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}